@@ -0,0 +1,225 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Per-kernel choice of the coarsening configuration in auto mode
+// ============================================================================
+
+#include <fstream>
+
+#include <llvm/Pass.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+#include "DivergenceAnalysisPass.h"
+#include "GridAnalysisPass.h"
+#include "BankConflictAnalysisPass.h"
+#include "CostModel.h"
+#include "BenefitAnalysisPass.h"
+#include "TargetDescription.h"
+
+extern cl::opt<std::string> CLCoarseningDimension;
+extern cl::opt<std::string> CLCoarseningAutoConfig;
+extern cl::opt<unsigned int> CLCoarseningAutoTolerance;
+
+bool CUDACoarseningPass::selectConfig(Function&         F,
+                                      CoarseningConfig& config)
+{
+    // Candidates are scored by the estimated speedup of the benefit
+    // analysis. Thread-level candidates in x are scaled by the change of
+    // the sectors per warp request and of the bank conflicts. The speedup
+    // grows with the factor while the parallelism left to hide latency
+    // shrinks, so the smallest factor within the tolerance of the best
+    // score is taken. Returns false if no candidate is profitable.
+    std::vector<unsigned int> factors = {2, 4, 8, 16, 32};
+    std::vector<unsigned int> strides = {1, 2, 4, 8, 32};
+    std::string savedAnalysisDimension = CLCoarseningDimension;
+    const targetDescription& target = getTargetDescription(F);
+
+    std::vector<std::pair<CoarseningConfig, double>> candidates;
+    for (unsigned int dimension = 0; dimension < CUDA_MAX_DIM; ++dimension) {
+        // The analyses follow the coarsened dimension.
+        CLCoarseningDimension = Util::dimensionToString(dimension);
+
+        GridAnalysisPass *grid = &getAnalysis<GridAnalysisPass>(F);
+        bool threadLevel =
+                !grid->getThreadIDDependentInstructions(dimension).empty();
+        bool blockLevel =
+                !grid->getBlockIDDependentInstructions(dimension).empty();
+
+        BenefitAnalysisPass *benefit = &getAnalysis<BenefitAnalysisPass>(F);
+        BankConflictAnalysisPass *bankConflicts =
+                                &getAnalysis<BankConflictAnalysisPass>(F);
+        double sectors = benefit->sectorsPerRequest(1, 1);
+        double conflicts = bankConflicts->conflictDegree(1, 1);
+
+        DivergenceAnalysisPassBL *divergenceBL =
+                                &getAnalysis<DivergenceAnalysisPassBL>(F);
+        m_divergentGlobals = divergenceBL->getDivergentGlobals(&F);
+
+        for (auto factor : factors) {
+            // Strides only change the accesses in x.
+            for (auto stride : strides) {
+                if (!threadLevel || (dimension != 0 && stride != 1)) {
+                    continue;
+                }
+
+                double score = benefit->getSpeedup(false, factor);
+                if (dimension == 0 && sectors > 0) {
+                    score *= sectors /
+                             benefit->sectorsPerRequest(factor, stride);
+                }
+                if (dimension == 0) {
+                    score *= conflicts /
+                             bankConflicts->conflictDegree(factor, stride);
+                }
+                candidates.push_back({{false, dimension, factor, stride},
+                                      score});
+            }
+
+            // Make sure we do not over-duplicate shared memory!
+            if (blockLevel &&
+                sharedFootprint(F, factor) < target.sharedPerBlock) {
+                candidates.push_back({{true, dimension, factor, 1},
+                                      benefit->getSpeedup(true, factor)});
+            }
+        }
+    }
+    CLCoarseningDimension = savedAnalysisDimension;
+
+    double best = 1;
+    for (auto& candidate : candidates) {
+        best = std::max(best, candidate.second);
+    }
+
+    const std::pair<CoarseningConfig, double> *selected = nullptr;
+    for (auto& candidate : candidates) {
+        if (candidate.second <= 1 ||
+            candidate.second * 100 < best * CLCoarseningAutoTolerance) {
+            continue;
+        }
+        if (!selected ||
+            candidate.first.factor < selected->first.factor ||
+            (candidate.first.factor == selected->first.factor &&
+             candidate.second > selected->second)) {
+            selected = &candidate;
+        }
+    }
+
+    OptimizationRemarkEmitter ORE(&F);
+    if (!selected) {
+        ORE.emit(OptimizationRemarkMissed(CUDA_COARSENING_REMARKS,
+                                          "AutoNotProfitable",
+                                          &F)
+                 << "no coarsening configuration is estimated to be "
+                 << "profitable");
+        return false;
+    }
+    config = selected->first;
+
+    std::stringstream tmp;
+    tmp << std::fixed << std::setprecision(2) << selected->second;
+    errs() << "--  INFO  -- Auto coarsening "
+           << (config.blockLevel ? "block" : "thread") << " mode, dimension "
+           << Util::dimensionToString(config.dimension) << ", factor "
+           << config.factor << ", stride " << config.stride
+           << " (estimated speedup " << tmp.str() << ")\n";
+
+    ORE.emit(OptimizationRemarkAnalysis(CUDA_COARSENING_REMARKS,
+                                        "AutoConfig",
+                                        &F)
+             << "selected "
+             << ore::NV("Mode", config.blockLevel ? "block" : "thread")
+             << " mode, dimension " << ore::NV("Dimension", config.dimension)
+             << ", factor " << ore::NV("Factor", config.factor)
+             << ", stride " << ore::NV("Stride", config.stride)
+             << ", estimated speedup " << ore::NV("Speedup", tmp.str()));
+    return true;
+}
+
+void CUDACoarseningPass::applyConfig(const CoarseningConfig& config)
+{
+    m_blockLevel = config.blockLevel;
+    m_swizzle = false;
+    m_dimension = config.dimension;
+    m_factor = config.factor;
+    m_stride = config.stride;
+
+    m_factors.assign(CUDA_MAX_DIM, 1);
+    m_strides.assign(CUDA_MAX_DIM, 1);
+    m_factors[m_dimension] = m_factor;
+    m_strides[m_dimension] = m_stride;
+}
+
+void CUDACoarseningPass::writeConfig(Function&               F,
+                                     const CoarseningConfig& config)
+{
+    // One line per kernel, '<kernel> <thread/block> <dimension> <factor>
+    // <stride>'. Kernels are matched by their mangled names, the host
+    // stubs are named as the kernels.
+    std::error_code EC;
+    raw_fd_ostream os(CLCoarseningAutoConfig, EC, sys::fs::OF_Append);
+    if (EC) {
+        errs() << "--  WARN  -- Cannot write auto configuration to "
+               << CLCoarseningAutoConfig << ": " << EC.message() << "\n";
+        return;
+    }
+
+    os << F.getName() << " " << (config.blockLevel ? "block" : "thread")
+       << " " << Util::dimensionToString(config.dimension) << " "
+       << config.factor << " " << config.stride << "\n";
+}
+
+bool CUDACoarseningPass::readConfigs()
+{
+    // Later lines of a kernel override the earlier ones.
+    m_autoConfigs.clear();
+
+    std::ifstream file(CLCoarseningAutoConfig);
+    if (!file) {
+        errs() << "CUDA Coarsening Pass Error: cannot open "
+               << CLCoarseningAutoConfig
+               << " (parameter: coarsening-auto-config)\n";
+        return false;
+    }
+
+    std::string line;
+    unsigned int lineNumber = 0;
+    while (std::getline(file, line)) {
+        ++lineNumber;
+
+        std::istringstream ts(line);
+        std::string kernel;
+        if (!(ts >> kernel)) {
+            // Empty line.
+            continue;
+        }
+
+        std::string mode;
+        std::string dimension;
+        CoarseningConfig config;
+        if (!(ts >> mode >> dimension >> config.factor >> config.stride) ||
+            (mode != "thread" && mode != "block") ||
+            (dimension != "x" && dimension != "y" && dimension != "z") ||
+            config.factor < 1 || config.stride < 1) {
+            errs() << "CUDA Coarsening Pass Error: "
+                   << CLCoarseningAutoConfig << ":" << lineNumber
+                   << ": expected '<kernel> <thread/block> <x/y/z> "
+                   << "<factor> <stride>' "
+                   << "(parameter: coarsening-auto-config)\n";
+            return false;
+        }
+        config.blockLevel = mode == "block";
+        config.dimension = Util::numeralDimension(dimension);
+        m_autoConfigs[kernel] = config;
+    }
+    return true;
+}
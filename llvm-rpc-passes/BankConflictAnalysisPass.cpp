@@ -0,0 +1,182 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Bank Conflict Analysis Pass
+// -> Shared memory bank conflicts of the coarsened versions of a kernel
+// ============================================================================
+
+#include <llvm/Pass.h>
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include "Common.h"
+#include "Util.h"
+#include "BankConflictAnalysisPass.h"
+#include "TargetDescription.h"
+
+using namespace llvm;
+
+// Memory access helpers.
+bool getLaneStride(const SCEV *scev, int64_t& stride);
+unsigned int bankConflictDegree(const std::vector<uint64_t>& addresses);
+
+// DATA
+char BankConflictAnalysisPass::ID = 0;
+
+// PUBLIC CONSTRUCTORS
+BankConflictAnalysisPass::BankConflictAnalysisPass()
+: FunctionPass(ID)
+{
+    m_target = findTargetDescription(CUDA_DEFAULT_TARGET);
+}
+
+// PUBLIC ACCESSORS
+void BankConflictAnalysisPass::printStatistics() const
+{
+    if (m_sharedAccesses.empty()) {
+        return;
+    }
+
+    std::vector<unsigned int> factors = {2, 4, 8, 16};
+    std::vector<unsigned int> strides = {1, 2, 4, 8, 32};
+
+    errs() << "\n\n";
+    errs() << "CUDA Coarsening Bank Conflict Analysis Pass results: \n";
+    errs() << "===================================================== \n";
+    errs() << "==== Mode ========= Stride ========= Factor ========= \n";
+    for (unsigned int stride : strides) {
+        std::stringstream tmp;
+        tmp << "==== THREAD ======= " << std::setw(2) << std::left << stride
+            << std::right << std::fixed << std::setprecision(2);
+        for (unsigned int factor : factors) {
+            tmp << "  " << factor << "x " << std::setw(5)
+                << conflictDegree(factor, stride);
+        }
+        errs() << tmp.str() << "\n";
+    }
+
+    std::stringstream tmp;
+    tmp << std::fixed << std::setprecision(2) << conflictDegree(1, 1);
+    errs() << "==== Not coarsened  " << tmp.str() << "\n";
+    errs() << "===================================================== \n";
+}
+
+const std::vector<sharedAccess>&
+BankConflictAnalysisPass::getSharedAccesses() const
+{
+    return m_sharedAccesses;
+}
+
+double BankConflictAnalysisPass::conflictDegree(
+                                    const sharedAccess& access,
+                                    unsigned int        factor,
+                                    unsigned int        stride) const
+{
+    // Lane 't' of a warp of the coarsened block does the work of the
+    // original thread '(t / st) * (cf * st) + t % st + k * st' in replica
+    // 'k'. Replicated arrays are accessed the same way by each replica.
+    uint64_t laneStride = std::abs(access.laneStride);
+    unsigned int degree = 0;
+    for (unsigned int k = 0; k < factor; ++k) {
+        std::vector<uint64_t> addresses;
+        for (unsigned int t = 0; t < m_target->warpSize; ++t) {
+            uint64_t tid = (t / stride) * (factor * stride) + t % stride +
+                           k * stride;
+            for (uint64_t offset = 0;
+                 offset < access.size;
+                 offset += SHARED_BANK_WIDTH) {
+                addresses.push_back(tid * laneStride + offset);
+            }
+        }
+        degree += bankConflictDegree(addresses);
+    }
+
+    return (double) degree / factor;
+}
+
+double BankConflictAnalysisPass::conflictDegree(unsigned int factor,
+                                                unsigned int stride) const
+{
+    if (m_sharedAccesses.empty()) {
+        return 1;
+    }
+
+    double degree = 0;
+    for (const sharedAccess& access : m_sharedAccesses) {
+        degree += conflictDegree(access, factor, stride);
+    }
+    return degree / m_sharedAccesses.size();
+}
+
+// PUBLIC MANIPULATORS
+void BankConflictAnalysisPass::getAnalysisUsage(AnalysisUsage& AU) const
+{
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+    AU.setPreservesAll();
+}
+
+bool BankConflictAnalysisPass::runOnFunction(Function& F)
+{
+    m_sharedAccesses.clear();
+
+    if (F.getParent()->getTargetTriple() != CUDA_TARGET_TRIPLE) {
+        // Run analysis only on device code.
+        return false;
+    }
+
+    // Apply the pass to kernels only, including the coarsened versions.
+    if (F.isDeclaration() || !Util::isKernelFunction(F)) {
+        return false;
+    }
+
+    m_scalarEvolution = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+    m_target = &getTargetDescription(F);
+
+    // Shared arrays are reached through addrspace(3) pointers, or generic
+    // pointers casted from them.
+    const DataLayout& DL = F.getParent()->getDataLayout();
+    for (BasicBlock &B : F) {
+        for (Instruction &I : B) {
+            Value *pointer = getLoadStorePointerOperand(&I);
+            if (!pointer) {
+                continue;
+            }
+
+            GlobalVariable *gv = dyn_cast<GlobalVariable>(
+                                            GetUnderlyingObject(pointer, DL));
+            if (pointer->getType()->getPointerAddressSpace() != 3 &&
+                (!gv || gv->getType()->getAddressSpace() != 3)) {
+                continue;
+            }
+
+            int64_t laneStride = 0;
+            const SCEV *address = m_scalarEvolution->getSCEV(pointer);
+            if (!getLaneStride(address, laneStride) || laneStride == 0) {
+                continue;
+            }
+
+            Type *type = isa<StoreInst>(&I)
+                         ? cast<StoreInst>(&I)->getValueOperand()->getType()
+                         : I.getType();
+            sharedAccess access;
+            access.inst = &I;
+            access.laneStride = laneStride;
+            access.size = DL.getTypeStoreSize(type);
+            m_sharedAccesses.push_back(access);
+        }
+    }
+
+    return false;
+}
+
+static RegisterPass<BankConflictAnalysisPass> X(
+                                        "cuda-bank-conflict-analysis-pass",
+                                        "CUDA Bank Conflict Analysis Pass",
+                                        false, // Only looks at CFG
+                                        true // Analysis pass
+                                        );
@@ -0,0 +1,60 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Bank Conflict Analysis Pass
+// ============================================================================
+
+#ifndef LLVM_LIB_TRANSFORMS_CUDA_COARSENING_BANKCONFLICTANALYSISPASS_H
+#define LLVM_LIB_TRANSFORMS_CUDA_COARSENING_BANKCONFLICTANALYSISPASS_H
+
+#define SHARED_BANKS       32 /* Number of shared memory banks              */
+#define SHARED_BANK_WIDTH   4 /* Width of a shared memory bank in bytes     */
+
+struct targetDescription;
+
+struct sharedAccess {
+    llvm::Instruction *inst;
+    int64_t            laneStride; // Bytes between neighbouring lanes
+    uint64_t           size;       // Bytes accessed by a lane
+};
+
+class BankConflictAnalysisPass : public llvm::FunctionPass {
+  public:
+    // CREATORS
+    BankConflictAnalysisPass();
+
+    // ACCESSORS
+    void printStatistics() const;
+
+    const std::vector<sharedAccess>& getSharedAccesses() const;
+        // Shared memory loads and stores of the kernel whose address depends
+        // on threadIdx.x, with a known distance between the lanes.
+
+    double conflictDegree(const sharedAccess& access,
+                          unsigned int        factor,
+                          unsigned int        stride) const;
+        // Expected number of words the busiest bank serves for a warp
+        // request of the 'access' once the kernel is coarsened at thread
+        // level in the x dimension, averaged over the replicas. One is
+        // conflict-free.
+
+    double conflictDegree(unsigned int factor, unsigned int stride) const;
+        // Average degree of all of the shared accesses, one if there are
+        // none.
+
+    // MANIPULATORS
+    void getAnalysisUsage(llvm::AnalysisUsage& AU) const override;
+    bool runOnFunction(llvm::Function& F) override;
+
+    // DATA
+    static char ID;
+
+  private:
+    // PRIVATE DATA
+    llvm::ScalarEvolution    *m_scalarEvolution;
+    const targetDescription  *m_target;
+
+    std::vector<sharedAccess> m_sharedAccesses;
+};
+
+#endif // LLVM_LIB_TRANSFORMS_CUDA_COARSENING_BANKCONFLICTANALYSISPASS_H
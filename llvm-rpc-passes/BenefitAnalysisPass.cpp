@@ -5,6 +5,10 @@
 #include <llvm/Pass.h>
 
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
 
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
@@ -14,27 +18,21 @@
 #include "Util.h"
 #include "GridAnalysisPass.h"
 #include "DivergenceAnalysisPass.h"
+#include "BankConflictAnalysisPass.h"
+#include "CostModel.h"
 #include "BenefitAnalysisPass.h"
+#include "TargetDescription.h"
 #include "RegionBounds.h"
 #include "DivergentRegion.h"
 
 extern cl::opt<std::string> CLCoarseningDimension;
 extern cl::opt<std::string> CLKernelName;
 extern cl::opt<std::string> CLCoarseningMode;
+extern cl::opt<std::string> CLCoarseningCostModel;
 
-std::unordered_map<unsigned int, unsigned int> g_opcodeCostMap = {
-    {Instruction::UDiv,  COST_DIV_NPOW2},
-    {Instruction::SDiv,  COST_DIV_NPOW2},
-    {Instruction::FDiv,  COST_DIV_NPOW2},
-    {Instruction::URem,  COST_MOD_NPOW2},
-    {Instruction::SRem,  COST_MOD_NPOW2},
-    {Instruction::FRem,  COST_MOD_NPOW2},
-    {Instruction::Br,    COST_BRANCH_DIV},
-    {Instruction::Store, COST_STORE_GLOBAL},
-    {Instruction::Load,  COST_LOAD_GLOBAL}
-};
-
-std::unordered_map<unsigned int, unsigned int>::iterator opcCostMapIt_t;
+// Memory access helpers.
+bool getLaneStride(const SCEV *scev, int64_t& stride);
+bool isGlobalAccess(Value *pointer, const DataLayout& DL);
 
 // DATA
 char BenefitAnalysisPass::ID = 0;
@@ -54,7 +52,7 @@ void BenefitAnalysisPass::printStatistics() const
     errs() << "===================================================== \n";
     errs() << "==== Mode ========= Factor ========= Duplication ==== \n";
 
-    std::vector<unsigned int> factors = {2, 4, 8, 16};
+    std::vector<unsigned int> factors = {2, 4, 8, 16, 32};
     for (unsigned int factor : factors) {
          errs() << "==== THREAD =======";
          errs() << " " << factor << "x";
@@ -64,8 +62,8 @@ void BenefitAnalysisPass::printStatistics() const
 
          errs() << "       ";
        
-         uint64_t benefit =  (factor - 1) * (m_totalTL - m_costTL);
-         uint64_t cost = duplicationCost(m_costTL, false, factor);
+         uint64_t benefit = getBenefit(false, factor);
+         uint64_t cost = getCost(false, factor);
 
          std::stringstream tmp;
          tmp << benefit << " / " << cost << " = " << std::setprecision(4) << 
@@ -83,8 +81,8 @@ void BenefitAnalysisPass::printStatistics() const
 
          errs() << "       ";
 
-         uint64_t benefit = (m_totalBL - m_costBL) * (factor - 1);
-         uint64_t cost = duplicationCost(m_costBL, true, factor);
+         uint64_t benefit = getBenefit(true, factor);
+         uint64_t cost = getCost(true, factor);
 
          std::stringstream tmp;
          tmp << benefit << " / " << cost << " = " << std::setprecision(4) << 
@@ -93,6 +91,138 @@ void BenefitAnalysisPass::printStatistics() const
          errs() << "\n";
     }
     errs() << "===================================================== \n";
+
+    if (m_globalAccesses.empty()) {
+        return;
+    }
+
+    // Sectors per warp request of the thread-level versions.
+    std::vector<unsigned int> strides = {1, 2, 4, 8, 32};
+    errs() << "==== Sectors ====== Stride ========= Factor ========= \n";
+    for (unsigned int stride : strides) {
+        std::stringstream tmp;
+        tmp << "==== THREAD ======= " << std::setw(2) << std::left << stride
+            << std::right << std::fixed << std::setprecision(2);
+        for (unsigned int factor : factors) {
+            tmp << "  " << factor << "x " << std::setw(5)
+                << sectorsPerRequest(factor, stride);
+        }
+        errs() << tmp.str() << "\n";
+    }
+
+    std::stringstream tmp;
+    tmp << std::fixed << std::setprecision(2) << sectorsPerRequest(1, 1);
+    errs() << "==== Not coarsened  " << tmp.str() << "\n";
+    errs() << "===================================================== \n";
+}
+
+uint64_t BenefitAnalysisPass::getBenefit(bool         blockLevel,
+                                         unsigned int factor) const
+{
+    // Work no longer duplicated by the merged threads (blocks).
+    return blockLevel ? (m_totalBL - m_costBL) * (factor - 1)
+                      : (m_totalTL - m_costTL) * (factor - 1);
+}
+
+uint64_t BenefitAnalysisPass::getCost(bool         blockLevel,
+                                      unsigned int factor) const
+{
+    return duplicationCost(blockLevel ? m_costBL : m_costTL,
+                           blockLevel,
+                           factor);
+}
+
+double BenefitAnalysisPass::getSpeedup(bool         blockLevel,
+                                       unsigned int factor) const
+{
+    // Work of 'factor' original threads (blocks) over the work of the one
+    // coarsened thread (block) performing it.
+    double total = blockLevel ? m_totalBL : m_totalTL;
+    double coarsened = total * factor - getBenefit(blockLevel, factor) +
+                       getCost(blockLevel, factor);
+    if (coarsened <= 0) {
+        return 1;
+    }
+    return total * factor / coarsened;
+}
+
+void BenefitAnalysisPass::emitRemarks(Function& F) const
+{
+    // The numbers of 'printStatistics', as analysis remarks of F.
+    OptimizationRemarkEmitter ORE(&F);
+    std::vector<unsigned int> factors = {2, 4, 8, 16, 32};
+    std::vector<unsigned int> strides = {1, 2, 4, 8, 32};
+
+    for (bool blockLevel : {false, true}) {
+        for (unsigned int factor : factors) {
+            ORE.emit(OptimizationRemarkAnalysis(CUDA_COARSENING_REMARKS,
+                                                "CoarseningBenefit",
+                                                &F)
+                     << "coarsening "
+                     << ore::NV("Mode", blockLevel ? "block" : "thread")
+                     << " " << ore::NV("Factor", factor) << "x, benefit "
+                     << ore::NV("Benefit", getBenefit(blockLevel, factor))
+                     << ", cost "
+                     << ore::NV("Cost", getCost(blockLevel, factor)));
+        }
+    }
+
+    if (m_globalAccesses.empty()) {
+        return;
+    }
+
+    for (unsigned int factor : factors) {
+        for (unsigned int stride : strides) {
+            std::stringstream tmp;
+            tmp << std::fixed << std::setprecision(2)
+                << sectorsPerRequest(factor, stride);
+            ORE.emit(OptimizationRemarkAnalysis(CUDA_COARSENING_REMARKS,
+                                                "CoarseningSectors",
+                                                &F)
+                     << "coarsening " << ore::NV("Mode", "thread") << " "
+                     << ore::NV("Factor", factor) << "x, stride "
+                     << ore::NV("Stride", stride) << ", sectors per request "
+                     << ore::NV("Sectors", tmp.str()));
+        }
+    }
+}
+
+double BenefitAnalysisPass::sectorsPerRequest(unsigned int factor,
+                                              unsigned int stride) const
+{
+    // Lane 't' of a warp of the coarsened block does the work of the
+    // original thread '(t / st) * (cf * st) + t % st + k * st' in replica
+    // 'k'. The sectors each replica touches are counted as if the warp
+    // started at a sector boundary.
+    uint64_t totalWeight = 0;
+    double sectors = 0;
+    for (const globalAccess& access : m_globalAccesses) {
+        uint64_t accessSectors = 0;
+        for (unsigned int k = 0; k < factor; ++k) {
+            std::set<int64_t> touched;
+            for (unsigned int t = 0; t < m_target->warpSize; ++t) {
+                int64_t tid = (t / stride) * (factor * stride) + t % stride +
+                              k * stride;
+                int64_t first = tid * access.laneStride;
+                int64_t last = first + (int64_t) access.size - 1;
+
+                // Floor division, the lane stride may be negative.
+                first = first >= 0 ? first / SECTOR_SIZE
+                                   : (first + 1) / SECTOR_SIZE - 1;
+                last = last >= 0 ? last / SECTOR_SIZE
+                                 : (last + 1) / SECTOR_SIZE - 1;
+                for (int64_t sector = first; sector <= last; ++sector) {
+                    touched.insert(sector);
+                }
+            }
+            accessSectors += touched.size();
+        }
+
+        sectors += access.weight * (double) accessSectors / factor;
+        totalWeight += access.weight;
+    }
+
+    return totalWeight ? sectors / totalWeight : 0;
 }
 
 // PUBLIC MANIPULATORS
@@ -103,6 +233,7 @@ void BenefitAnalysisPass::getAnalysisUsage(llvm::AnalysisUsage& AU) const
     AU.addRequired<DivergenceAnalysisPassTL>();
     AU.addRequired<DivergenceAnalysisPassBL>();
     AU.addRequired<GridAnalysisPass>();
+    AU.addRequired<BankConflictAnalysisPass>();
     AU.setPreservesAll();
 }
 
@@ -117,7 +248,8 @@ bool BenefitAnalysisPass::runOnFunction(llvm::Function& F)
     if (!Util::shouldCoarsen(F,
                              CLKernelName,
                              false,
-                             CLCoarseningMode == "dynamic")) {
+                             CLCoarseningMode == "dynamic" ||
+                             CLCoarseningMode == "auto")) {
         return false;
     }
 
@@ -128,6 +260,21 @@ bool BenefitAnalysisPass::runOnFunction(llvm::Function& F)
     m_divergenceAnalysisTL = &getAnalysis<DivergenceAnalysisPassTL>();
     m_divergenceAnalysisBL = &getAnalysis<DivergenceAnalysisPassBL>();
     m_gridAnalysis = &getAnalysis<GridAnalysisPass>();
+    m_bankConflictAnalysis = &getAnalysis<BankConflictAnalysisPass>();
+    m_target = &getTargetDescription(F);
+
+    std::string error;
+    m_costModel.reset(*m_target);
+    if (!CLCoarseningCostModel.empty()) {
+        // Errors are reported by the coarsening pass.
+        m_costModel.load(CLCoarseningCostModel, error);
+    }
+
+    for (const sharedAccess& access :
+                            m_bankConflictAnalysis->getSharedAccesses()) {
+        m_sharedConflicts[access.inst] =
+                    m_bankConflictAnalysis->conflictDegree(access, 1, 1);
+    }
 
     m_totalTL = 0;
     m_costTL = 0;
@@ -192,110 +339,54 @@ bool BenefitAnalysisPass::runOnFunction(llvm::Function& F)
         m_costBL = m_totalBL;
     }
 
-    return false;
-}
-
-// PRIVATE ACCESSORS
-bool isPow2(int i) {
-    if ( i <= 0 ) {
-        return 0;
-    }
-
-    return !(i & (i - 1));
-}
-
-uint64_t BenefitAnalysisPass::getCostForInstruction(Instruction *pI)
-{
-    uint64_t instCost = COST_DEFAULT;
-
-    auto costMapIt = g_opcodeCostMap.find(pI->getOpcode());
-    if (costMapIt != g_opcodeCostMap.end()) {
-        instCost = costMapIt->second;
-    }
-
-    // Handle special cases
-    if (pI->getOpcode() == Instruction::UDiv ||
-        pI->getOpcode() == Instruction::SDiv ||
-        pI->getOpcode() == Instruction::FDiv) {
-            ConstantInt *c = dyn_cast<ConstantInt>(pI->getOperand(1));
-            if (c) {
-                if (isPow2(c->getLimitedValue())) {
-                    instCost = COST_DIV_POW2;
-                }
-            }
-    }
-
-    if (pI->getOpcode() == Instruction::URem ||
-        pI->getOpcode() == Instruction::SRem ||
-        pI->getOpcode() == Instruction::FRem) {
-            ConstantInt *c = dyn_cast<ConstantInt>(pI->getOperand(1));
-            if (c) {
-                if (isPow2(c->getLimitedValue())) {
-                    instCost = COST_MOD_POW2;
-                }
+    // Global accesses whose address depends on threadIdx.x, their
+    // coalescing depends on the coarsening stride. Others take the same
+    // sectors in all of the versions.
+    const DataLayout& DL = F.getParent()->getDataLayout();
+    for (BasicBlock &B : F) {
+        for (Instruction &I : B) {
+            Value *pointer = getLoadStorePointerOperand(&I);
+            if (!pointer || !isGlobalAccess(pointer, DL)) {
+                continue;
             }
-    }
 
-    //if (isa<StoreInst>(pI)) {
-    //    StoreInst *store = dyn_cast<StoreInst>(pI);
-    //    if (store->getSt)
-    //}
-
-    BasicBlock *parent = pI->getParent();
-    Loop *loop = m_loopInfo->getLoopFor(parent);
-    if (loop != nullptr) {
-        // Instruction considered resides within a loop. To amplify the
-        // this fact within the measured metric, we try to compute how many
-        // times the instruction executes. This relies on two factors:
-        // a) loop depth
-        // b) (total) trip count
-        // The latter can only be computed for some of the loops (where the
-        // trip count is known at the compile time).
-
-        uint64_t depth = m_loopInfo->getLoopDepth(parent);
-        for (uint64_t i = 0; i < m_loopInfo->getLoopDepth(parent); ++i) {
-            uint64_t loopCost = this->loopCost(loop);
-            if (!loopCost) {
-           //     errs() << "Only have loop depth: " << depth << " " << instCost << "\n";
-                return depth * instCost;
+            int64_t laneStride = 0;
+            const SCEV *address = m_scalarEvolution->getSCEV(pointer);
+            if (!getLaneStride(address, laneStride) || laneStride == 0) {
+                continue;
             }
 
-            instCost *= loopCost;
-            loop = loop->getParentLoop();
+            Type *type = isa<StoreInst>(&I)
+                         ? cast<StoreInst>(&I)->getValueOperand()->getType()
+                         : I.getType();
+            globalAccess access;
+            access.laneStride = laneStride;
+            access.size = DL.getTypeStoreSize(type);
+            access.weight = getCostForInstruction(&I);
+            m_globalAccesses.push_back(access);
         }
-
-        //errs() << "Got trip count: " << totalCost << " ";
-        //        pI->dump();
-
-        //retVal = totalCost;
     }
 
-    return instCost;
+    return false;
 }
 
-uint64_t BenefitAnalysisPass::loopCost(Loop *loop)
+// PRIVATE ACCESSORS
+uint64_t BenefitAnalysisPass::getCostForInstruction(Instruction *pI)
 {
-    ScalarEvolution *SE = m_scalarEvolution;
-
-    if (SE->hasLoopInvariantBackedgeTakenCount(loop)) {
-        const SCEV *takenCount = SE->getBackedgeTakenCount(loop);
-        if (!isa<SCEVCouldNotCompute>(takenCount)) {
-            // We were able to find statically known trip count for this
-            // loop.
+    double instCost = m_costModel.getCost(pI);
 
-            if (!isa<SCEVConstant>(takenCount)) {
-                return 0; 
-            }
-
-            auto val = cast<SCEVConstant>(takenCount)->getAPInt();
-            unsigned int tripCount = val.getLimitedValue(UINT64_MAX - 1);
-
-            return tripCount;
-        }
+    // Shared memory accesses are serialized by bank conflicts.
+    auto conflictsIt = m_sharedConflicts.find(pI);
+    if (conflictsIt != m_sharedConflicts.end()) {
+        instCost *= conflictsIt->second;
     }
 
-    // Static analysis is not possible.
-    return 0;
+    // Instruction considered may reside within a loop. To amplify this
+    // fact within the measured metric, we try to compute how many times
+    // the instruction executes.
+    return instCost * CostModel::executionCount(pI,
+                                                m_loopInfo,
+                                                m_scalarEvolution);
 }
 
 uint64_t BenefitAnalysisPass::duplicationCost(uint64_t     divergentCost,
@@ -310,7 +401,7 @@ uint64_t BenefitAnalysisPass::duplicationCost(uint64_t     divergentCost,
                 ? m_gridAnalysis->getGridSizeDependentInstructions(dimension)
                 : m_gridAnalysis->getBlockSizeDependentInstructions(dimension);
 
-    result += sizeInsts.size() * COST_DEFAULT;
+    result += sizeInsts.size() * m_target->costDefault;
 
     InstVector tids = 
                 blockLevel
@@ -319,14 +410,14 @@ uint64_t BenefitAnalysisPass::duplicationCost(uint64_t     divergentCost,
     
     // origTid = [newTid / st] * (cf * st) + newTid % st + subid * st
 
-    result += tids.size() * COST_DIV_POW2; // newTid / st [div]
-    result += tids.size() * COST_DEFAULT; // * (cf * st) [mul]
-    result += tids.size() * COST_MOD_POW2; // newTid % st [mod]
-    result += tids.size() * COST_DEFAULT; // [mul] + [mod]
+    result += tids.size() * m_target->costDivPow2; // newTid / st [div]
+    result += tids.size() * m_target->costDefault; // * (cf * st) [mul]
+    result += tids.size() * m_target->costModPow2; // newTid % st [mod]
+    result += tids.size() * m_target->costDefault; // [mul] + [mod]
 
     // subIds
     for (unsigned int index = 2; index <= factor; ++index) {
-        result += tids.size() * COST_DEFAULT;
+        result += tids.size() * m_target->costDefault;
     }
 
     // duplication
@@ -339,6 +430,9 @@ uint64_t BenefitAnalysisPass::duplicationCost(uint64_t     divergentCost,
 void BenefitAnalysisPass::clear()
 {
     //originalCost = 0;
+    m_target = findTargetDescription(CUDA_DEFAULT_TARGET);
+    m_globalAccesses.clear();
+    m_sharedConflicts.clear();
 }
 
 static RegisterPass<BenefitAnalysisPass> X("cuda-benefit-analysis-pass",
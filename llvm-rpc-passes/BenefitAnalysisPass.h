@@ -5,18 +5,7 @@
 #ifndef LLVM_LIB_TRANSFORMS_CUDA_COARSENING_BENEFITANALYSISPASS_H
 #define LLVM_LIB_TRANSFORMS_CUDA_COARSENING_BENEFITANALYSISPASS_H
 
-#define COST_DEFAULT      100   /* Default instruction cost                   */
-#define COST_DIV_POW2     200   /* Division cost, divisor is power of two     */
-#define COST_DIV_NPOW2    300   /* Division cost, divisor is not power of two */
-#define COST_MOD_POW2     150   /* Modulo cost, divisor is power of two       */
-#define COST_MOD_NPOW2    350   /* Modulo cost, divisor is not power of two   */
-#define COST_LOAD_SHARED  150   /* Cost of shared memory load                 */
-#define COST_STORE_SHARED 150   /* Cost of shared memory store                */
-#define COST_LOAD_GLOBAL  200   /* Cost of global memory load                 */
-#define COST_STORE_GLOBAL 200   /* Cost of global memory store                */
-#define COST_BRANCH_DIV   150   /* Cost of divergent branch                   */
-#define COST_MATH_FUNC_F  200   /* Cost of FP32 built-in math function        */
-#define COST_MATH_FUNC_D  300   /* Cost of FP64 built-in math function        */
+#define SECTOR_SIZE        32   /* Bytes of a global memory sector            */
 
 /* struct coarseningBenefit {
   uint64_t benefit;
@@ -25,6 +14,15 @@
 
 //typedef std::unordered_map<unsigned int, coarseningBenefit> benefitMap_t; 
 
+struct globalAccess {
+    int64_t  laneStride; // Bytes between the addresses of neighbouring lanes
+    uint64_t size;       // Bytes accessed by a lane
+    uint64_t weight;     // Estimated executions (cost) of the access
+};
+
+class BankConflictAnalysisPass;
+struct targetDescription;
+
 class BenefitAnalysisPass : public llvm::FunctionPass {
   public:
     // CREATORS
@@ -32,6 +30,24 @@ class BenefitAnalysisPass : public llvm::FunctionPass {
 
     // ACCESSORS
     void printStatistics() const;
+    void emitRemarks(llvm::Function& F) const;
+        // Emits the benefit and cost of the versions, and the sectors per
+        // request of the thread-level ones, as optimization remarks of F.
+
+    uint64_t getBenefit(bool blockLevel, unsigned int factor) const;
+    uint64_t getCost(bool blockLevel, unsigned int factor) const;
+        // Estimated work saved (added) by coarsening the kernel 'factor'
+        // times at thread or block level.
+
+    double getSpeedup(bool blockLevel, unsigned int factor) const;
+        // Estimated speedup of coarsening the kernel 'factor' times at
+        // thread or block level, ignoring the lost parallelism.
+
+    double sectorsPerRequest(unsigned int factor, unsigned int stride) const;
+        // Expected number of 32-byte sectors a warp request to global memory
+        // takes once the kernel is coarsened at thread level in the x
+        // dimension, averaged over the replicas and weighted by the cost of
+        // the accesses. Returns 0 if no access depends on threadIdx.x.
 
     // MANIPULATORS
     void getAnalysisUsage(llvm::AnalysisUsage& AU) const override;
@@ -43,7 +59,6 @@ class BenefitAnalysisPass : public llvm::FunctionPass {
   private:
     // PRIVATE ACCESSORS
     uint64_t getCostForInstruction(llvm::Instruction *pI);
-    uint64_t loopCost(llvm::Loop *loop);
     uint64_t duplicationCost(uint64_t     divergentCost,
                              bool         blockLevel,
                              unsigned int factor) const;
@@ -57,12 +72,18 @@ class BenefitAnalysisPass : public llvm::FunctionPass {
     GridAnalysisPass       *m_gridAnalysis;
     DivergenceAnalysisPass *m_divergenceAnalysisTL;
     DivergenceAnalysisPass *m_divergenceAnalysisBL;
+    BankConflictAnalysisPass *m_bankConflictAnalysis;
+    const targetDescription *m_target;
+    CostModel               m_costModel;
 
     uint64_t                m_totalTL;
     uint64_t                m_costTL;
     uint64_t                m_totalBL;
     uint64_t                m_costBL;
 
+    std::vector<globalAccess> m_globalAccesses;
+    std::map<llvm::Instruction *, double> m_sharedConflicts;
+
     //benefitMap_t            m_benefitMapTL;
     //benefitMap_t            m_benefitMapBL;
 };
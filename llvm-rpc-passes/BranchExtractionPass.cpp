@@ -20,6 +20,7 @@
 #include "Util.h"
 #include "GridAnalysisPass.h"
 #include "DivergenceAnalysisPass.h"
+#include "CostModel.h"
 #include "BenefitAnalysisPass.h"
 #include "RegionBounds.h"
 #include "DivergentRegion.h"
@@ -52,7 +53,9 @@ void BranchExtractionPass::getAnalysisUsage(AnalysisUsage& AU) const
 bool BranchExtractionPass::runOnFunction(Function& F)
 {
     // Apply the pass to kernels only.
-    if (!Util::shouldCoarsen(F, CLKernelName, false, CLCoarseningMode == "dynamic")) {
+    if (!Util::shouldCoarsen(F, CLKernelName, false,
+                             CLCoarseningMode == "dynamic" ||
+                             CLCoarseningMode == "auto")) {
         return false;
     }
 
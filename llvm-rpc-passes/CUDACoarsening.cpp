@@ -15,11 +15,13 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/DiagnosticInfo.h"
 
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 
@@ -28,7 +30,15 @@
 #include "Util.h"
 #include "DivergenceAnalysisPass.h"
 #include "GridAnalysisPass.h"
+#include "BankConflictAnalysisPass.h"
+#include "CostModel.h"
 #include "BenefitAnalysisPass.h"
+#include "TargetDescription.h"
+#include "RegionBounds.h"
+#include "DivergentRegion.h"
+
+// NVVM annotation helpers.
+void clearAnnotationCache(const Module *Mod);
 
 // Command line parameters
 cl::opt<std::string> CLKernelName("coarsened-kernel",
@@ -51,11 +61,240 @@ cl::opt<std::string> CLCoarseningDimension("coarsening-dimension",
                                            cl::Hidden,
                                            cl::desc("Coarsening dimension"));
 
+cl::opt<std::string> CLCoarseningTile(
+                        "coarsening-tile",
+                        cl::init(""),
+                        cl::Hidden,
+                        cl::desc("Coarsening factors of the x, y and z "
+                                 "dimensions at once, e.g. 4x2 (overrides "
+                                 "coarsening-factor and "
+                                 "coarsening-dimension)"));
+
+cl::opt<std::string> CLCoarseningTileStride(
+                        "coarsening-tile-stride",
+                        cl::init(""),
+                        cl::Hidden,
+                        cl::desc("Coarsening strides of the x, y and z "
+                                 "dimensions of the tile, e.g. 1x2"));
+
+cl::opt<std::string> CLCoarseningSwizzle(
+                        "coarsening-swizzle",
+                        cl::init("none"),
+                        cl::Hidden,
+                        cl::desc("Order of the blocks of block-level "
+                                 "coarsening (none/diagonal)"));
+
+cl::opt<std::string> CLCoarseningTarget(
+                        "coarsening-target",
+                        cl::init(""),
+                        cl::Hidden,
+                        cl::desc("GPU the resource limits and costs are taken "
+                                 "from, e.g. sm_70 (defaults to the target "
+                                 "CPU of the kernel)"));
+
+cl::opt<std::string> CLCoarseningCostModel(
+                        "coarsening-cost-model",
+                        cl::init(""),
+                        cl::Hidden,
+                        cl::desc("File overriding the instruction costs of "
+                                 "the benefit analysis, e.g. as fitted by "
+                                 "rpc-calibrate"));
+
+cl::opt<std::string> CLCoarseningCostFeatures(
+                        "coarsening-cost-features",
+                        cl::init(""),
+                        cl::Hidden,
+                        cl::desc("File the executions of the instructions "
+                                 "of every version by cost key are appended "
+                                 "to, the input of rpc-calibrate"));
+
 cl::opt<std::string> CLCoarseningMode(
                             "coarsening-mode",
                             cl::init("block"),
                             cl::Hidden,
-                            cl::desc("Coarsening mode (thread/block/dynamic)"));
+                            cl::desc("Coarsening mode "
+                                     "(thread/block/dynamic/auto)"));
+
+cl::opt<std::string> CLCoarseningAutoConfig(
+                        "coarsening-auto-config",
+                        cl::init(""),
+                        cl::Hidden,
+                        cl::desc("File the configurations chosen in auto mode "
+                                 "are appended to by the device code pass, "
+                                 "and read from by the host code pass"));
+
+cl::opt<unsigned int> CLCoarseningAutoTolerance(
+                        "coarsening-auto-tolerance",
+                        cl::init(95),
+                        cl::Hidden,
+                        cl::desc("Auto mode takes the smallest factor whose "
+                                 "estimated speedup is within the given "
+                                 "percentage of the best one"));
+
+cl::opt<bool> CLCoarseningGridStride(
+                        "coarsening-grid-stride",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Coarsen grid-stride loop kernels by "
+                                 "launching fewer threads, without replication"));
+
+cl::opt<bool> CLCoarseningAffine(
+                        "coarsening-affine-divergence",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Do not replicate values that are uniform "
+                                 "across the replicas"));
+
+cl::opt<std::string> CLCoarseningRegionMode(
+                        "coarsening-region-mode",
+                        cl::init("classic"),
+                        cl::Hidden,
+                        cl::desc("Divergent region replication "
+                                 "(classic/merged)"));
+
+cl::opt<unsigned int> CLCoarseningMergeThreshold(
+                        "coarsening-merge-threshold",
+                        cl::init(16),
+                        cl::Hidden,
+                        cl::desc("Maximum number of instructions of a region "
+                                 "flattened in merged mode"));
+
+cl::opt<bool> CLCoarseningEarlyExits(
+                        "coarsening-early-exits",
+                        cl::init(false),
+                        cl::Hidden,
+                        cl::desc("Normalize early returns into per-replica "
+                                 "active masks instead of replicating the rest "
+                                 "of the kernel as a region"));
+
+cl::opt<bool> CLCoarseningGuarded(
+                        "coarsening-guarded",
+                        cl::init(false),
+                        cl::Hidden,
+                        cl::desc("Guard every replica with the original grid "
+                                 "extent, so that any problem size can be "
+                                 "coarsened"));
+
+cl::opt<std::string> CLCoarseningSmemLayout(
+                        "coarsening-smem-layout",
+                        cl::init("auto"),
+                        cl::Hidden,
+                        cl::desc("Layout of the replicated shared memory "
+                                 "arrays (separate/concatenated/interleaved/"
+                                 "auto)"));
+
+cl::opt<bool> CLCoarseningSmemPadding(
+                        "coarsening-smem-padding",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Pad interleaved shared memory arrays after "
+                                 "every row of banks"));
+
+cl::opt<bool> CLCoarseningSmemAliasing(
+                        "coarsening-smem-aliasing",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Share the storage of shared memory arrays "
+                                 "whose barrier-delimited live ranges are "
+                                 "disjoint"));
+
+cl::opt<bool> CLCoarseningStaging(
+                        "coarsening-staging",
+                        cl::init(false),
+                        cl::Hidden,
+                        cl::desc("Stage the global accesses of stride-1 "
+                                 "thread coarsening through shared memory, "
+                                 "copied cooperatively (needs launch "
+                                 "bounds)"));
+
+cl::opt<bool> CLCoarseningPreReduce(
+                        "coarsening-pre-reduce",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Combine the replicas' values in registers "
+                                 "before shared memory tree reductions"));
+
+cl::opt<bool> CLCoarseningAggregateAtomics(
+                        "coarsening-aggregate-atomics",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Combine the atomics of the replicas to "
+                                 "the same address into one atomic"));
+
+cl::opt<bool> CLCoarseningSplitBarriers(
+                        "coarsening-split-barriers",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Split the divergent regions at barriers "
+                                 "instead of replicating the barriers"));
+
+cl::opt<bool> CLCoarseningFuseLoops(
+                        "coarsening-fuse-loops",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Fuse the replicas of divergent loops into "
+                                 "a single loop"));
+
+cl::opt<bool> CLCoarseningLoadReuse(
+                        "coarsening-load-reuse",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Reuse loads of the same address across "
+                                 "replicas"));
+
+cl::opt<bool> CLCoarseningVectorize(
+                        "coarsening-vectorize",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Merge replicated loads and stores of "
+                                 "consecutive elements into vector accesses"));
+
+cl::opt<bool> CLCoarseningAssumeAligned(
+                        "coarsening-assume-aligned",
+                        cl::init(false),
+                        cl::Hidden,
+                        cl::desc("Assume replicated accesses are aligned to "
+                                 "the vector size (e.g. cudaMalloc'd arrays "
+                                 "with a row pitch multiple of the factor)"));
+
+cl::opt<bool> CLCoarseningSchedule(
+                        "coarsening-schedule",
+                        cl::init(true),
+                        cl::Hidden,
+                        cl::desc("Hoist replicated loads ahead of their uses"));
+
+cl::opt<unsigned int> CLCoarseningScheduleRegs(
+                        "coarsening-schedule-regs",
+                        cl::init(32),
+                        cl::Hidden,
+                        cl::desc("Maximum number of 32-bit registers held by "
+                                 "hoisted loads between memory side effects"));
+
+cl::opt<unsigned int> CLCoarseningPrefetch(
+                        "coarsening-prefetch",
+                        cl::init(8),
+                        cl::Hidden,
+                        cl::desc("Maximum number of global loads of the next "
+                                 "replica of a region prefetched by "
+                                 "block-level replicas (0 disables)"));
+
+cl::opt<unsigned int> CLCoarseningPruneSectors(
+                        "coarsening-prune-sectors",
+                        cl::init(0),
+                        cl::Hidden,
+                        cl::desc("Skip thread-level versions whose global "
+                                 "accesses take more sectors per warp request "
+                                 "than the best stride, by more than the "
+                                 "given percentage (0 disables)"));
+
+cl::opt<unsigned int> CLCoarseningPruneConflicts(
+                        "coarsening-prune-conflicts",
+                        cl::init(0),
+                        cl::Hidden,
+                        cl::desc("Skip thread-level versions whose shared "
+                                 "accesses have more bank conflicts than the "
+                                 "best stride, by more than the given "
+                                 "percentage (0 disables)"));
 
 using namespace llvm;
 
@@ -131,13 +370,17 @@ void CUDACoarseningPass::getAnalysisUsage(AnalysisUsage& AU) const
     AU.addRequired<DivergenceAnalysisPassTL>();
     AU.addRequired<DivergenceAnalysisPassBL>();
     AU.addRequired<BenefitAnalysisPass>();
+    AU.addRequired<BankConflictAnalysisPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
 }
 
 bool CUDACoarseningPass::parseConfig()
 {
     // Parse command line configuration
     m_dynamicMode = false;
+    m_autoMode = false;
     m_blockLevel = false;
+    m_swizzle = false;
     
     if (CLCoarseningMode == "dynamic") {
         m_dynamicMode = true;
@@ -145,19 +388,68 @@ bool CUDACoarseningPass::parseConfig()
     else if (CLCoarseningMode == "block") {
         m_blockLevel = true;
     }
+    else if (CLCoarseningMode == "auto") {
+        m_autoMode = true;
+    }
     else if (CLCoarseningMode != "thread") {
         errs() << "CUDA Coarsening Pass Error: wrong coarsening mode specified "
                << "(parameter: coarsening-mode)\n";
     }
 
+    if (CLCoarseningSmemLayout != "separate" &&
+        CLCoarseningSmemLayout != "concatenated" &&
+        CLCoarseningSmemLayout != "interleaved" &&
+        CLCoarseningSmemLayout != "auto") {
+        errs() << "CUDA Coarsening Pass Error: wrong shared memory layout "
+               << "specified (parameter: coarsening-smem-layout)\n";
+
+        return false;
+    }
+
+    if (CLCoarseningRegionMode != "classic" &&
+        CLCoarseningRegionMode != "merged") {
+        errs() << "CUDA Coarsening Pass Error: wrong region mode specified "
+               << "(parameter: coarsening-region-mode)\n";
+    }
+
     m_kernelName = CLKernelName;
-    if (m_kernelName.empty() && !m_dynamicMode) {
+    if (m_kernelName.empty() && !m_dynamicMode && !m_autoMode) {
         errs() << "CUDA Coarsening Pass Error: no kernel specified "
                << "(parameter: coarsened-kernel)\n";
         
         return false;
     }
 
+    if (m_autoMode && CLCoarseningAutoConfig.empty()) {
+        errs() << "CUDA Coarsening Pass Error: no configuration file "
+               << "specified (parameter: coarsening-auto-config)\n";
+
+        return false;
+    }
+
+    if (CLCoarseningSwizzle != "none" && CLCoarseningSwizzle != "diagonal") {
+        errs() << "CUDA Coarsening Pass Error: wrong swizzle specified "
+               << "(parameter: coarsening-swizzle)\n";
+
+        return false;
+    }
+
+    std::string costModelError;
+    CostModel costModel;
+    if (!CLCoarseningCostModel.empty() &&
+        !costModel.load(CLCoarseningCostModel, costModelError)) {
+        errs() << "CUDA Coarsening Pass Error: " << costModelError
+               << " (parameter: coarsening-cost-model)\n";
+        return false;
+    }
+
+    if (!CLCoarseningTarget.empty() &&
+        !findTargetDescription(CLCoarseningTarget)) {
+        errs() << "CUDA Coarsening Pass Error: unknown target specified, "
+               << "using " << CUDA_DEFAULT_TARGET
+               << " (parameter: coarsening-target)\n";
+    }
+
     if (!(CLCoarseningDimension == "x" ||
           CLCoarseningDimension == "y" ||
           CLCoarseningDimension == "z" )) {
@@ -165,21 +457,76 @@ bool CUDACoarseningPass::parseConfig()
                 << "(parameter: coarsening-dimension)\n";
     }
 
-    if (!m_dynamicMode) {
+    if (!m_dynamicMode && !m_autoMode) {
         // In regular mode, configuration parameters need to be set.
         m_factor = CLCoarseningFactor;
         m_stride = CLCoarseningStride;
         m_dimension = Util::numeralDimension(CLCoarseningDimension);
+
+        // Tiles coarsen several dimensions at once.
+        m_factors.assign(CUDA_MAX_DIM, 1);
+        m_strides.assign(CUDA_MAX_DIM, 1);
+        if (CLCoarseningTile.empty()) {
+            m_factors[m_dimension] = m_factor;
+            m_strides[m_dimension] = m_stride;
+        }
+        else if (!Util::parseTile(CLCoarseningTile, m_factors) ||
+                 (!CLCoarseningTileStride.empty() &&
+                  !Util::parseTile(CLCoarseningTileStride, m_strides))) {
+            errs() << "CUDA Coarsening Pass Error: wrong tile specified "
+                   << "(parameter: coarsening-tile)\n";
+            return false;
+        }
+
+        unsigned int coarsened = 0;
+        for (unsigned int dimension = 0;
+             dimension < CUDA_MAX_DIM;
+             ++dimension) {
+            if (m_factors[dimension] > 1) {
+                m_dimension = dimension;
+                m_factor = m_factors[dimension];
+                m_stride = m_strides[dimension];
+                ++coarsened;
+            }
+        }
+
+        m_swizzle = CLCoarseningSwizzle == "diagonal";
+        if (m_swizzle && !m_blockLevel) {
+            errs() << "CUDA Coarsening Pass Error: swizzling applies to "
+                   << "block-level coarsening only "
+                   << "(parameter: coarsening-swizzle)\n";
+            return false;
+        }
+
+        if (coarsened > 1 && CLCoarseningGuarded) {
+            errs() << "CUDA Coarsening Pass Error: guarded mode coarsens "
+                   << "a single dimension only (parameter: coarsening-tile)\n";
+            return false;
+        }
     }
 
     errs() << "\nCUDA Coarsening Pass configuration:";
     errs() << " kernel: " << (CLKernelName.empty() ? "<all>" : m_kernelName);
     errs() << ", mode: " << CLCoarseningMode << " ";
-    if (!m_dynamicMode) {
+    bool staticMode = !m_dynamicMode && !m_autoMode;
+    if (staticMode && !CLCoarseningTile.empty()) {
+        errs() << "tile " << CLCoarseningTile;
+        errs() << ", (strides: " << (CLCoarseningTileStride.empty()
+                                     ? std::string("1")
+                                     : CLCoarseningTileStride.getValue())
+               << ")";
+    }
+    else if (staticMode) {
         errs() << CLCoarseningFactor << "x";
         errs() << ", (stride: " << CLCoarseningStride;
         errs() << ", dimension: " << CLCoarseningDimension << ")";
     }
+    if (m_swizzle) {
+        errs() << ", swizzle: " << CLCoarseningSwizzle;
+    }
+    if (!CLCoarseningTarget.empty()) {
+        errs() << ", target: " << CLCoarseningTarget;
+    }
     errs() << "\n";
 
     return true;
@@ -195,27 +542,55 @@ bool CUDACoarseningPass::handleDeviceCode(Module& M)
         return false;
     }
 
-    bool foundKernel = false;
+    // Guarded kernels are replaced by a version taking the extent argument,
+    // collect the kernels first.
+    std::vector<Function *> kernels;
     for (auto& F : M) {
         if (shouldCoarsen(F)) {
-            std::string name = Util::demangle(F.getName());
-            name = Util::nameFromDemangled(name);
+            kernels.push_back(&F);
+        }
+    }
 
-            foundKernel = true;
+    bool foundKernel = false;
+    for (Function *kernel : kernels) {
+        std::string name = Util::demangle(kernel->getName());
+        name = Util::nameFromDemangled(name);
+
+        foundKernel = true;
 
-            errs() << "--  INFO  -- Found CUDA kernel: " << name << "\n";
+        errs() << "--  INFO  -- Found CUDA kernel: " << name << "\n";
 
-            analyzeKernel(F);
+        getAnalysis<BenefitAnalysisPass>(*kernel).emitRemarks(*kernel);
 
-            if (m_dynamicMode) {
-                generateVersions(F, true);
+        if (m_autoMode) {
+            // Every kernel is coarsened by its own configuration, the host
+            // code pass reads it back to scale the launches.
+            CoarseningConfig config;
+            if (!selectConfig(*kernel, config)) {
+                errs() << "--  INFO  -- Coarsening " << name
+                       << " not profitable, skipped\n";
                 continue;
             }
+            applyConfig(config);
+            writeConfig(*kernel, config);
+        }
 
-            scaleKernelGrid();
-            coarsenKernel(F);
-            replacePlaceholders();
+        if (m_dynamicMode) {
+            analyzeKernel(*kernel);
+            generateVersions(*kernel, true);
+            writeCostFeatures(*kernel, 1);
+            continue;
         }
+
+        if (CLCoarseningGuarded) {
+            kernel = appendExtentArgument(*kernel);
+        }
+        coarsenTile(*kernel, *kernel);
+        writeCostFeatures(*kernel,
+                          std::accumulate(m_factors.begin(),
+                                          m_factors.end(),
+                                          1u,
+                                          std::multiplies<unsigned int>()));
     }
 
     return foundKernel;
@@ -227,6 +602,10 @@ bool CUDACoarseningPass::handleHostCode(Module& M)
 
     bool foundGrid = false;
 
+    if (m_autoMode && !readConfigs()) {
+        return false;
+    }
+
     insertRPCFunctions(M);
 
     // We are replacing function call instructions; this array will hold the
@@ -269,14 +648,38 @@ bool CUDACoarseningPass::handleHostCode(Module& M)
                         continue;
                     }
 
+                    if (m_autoMode) {
+                        // Kernels not coarsened by the device code pass
+                        // keep their launches.
+                        auto config =
+                                m_autoConfigs.find(kernelF->getName().str());
+                        if (config == m_autoConfigs.end()) {
+                            continue;
+                        }
+                        applyConfig(config->second);
+                    }
+
                     errs() << "--  INFO  -- Found cudaLaunch of " << kernel;
                     errs() << "\n";
                     foundGrid = true;
 
                     if (m_dynamicMode) {
                         // In dynamic mode, replace the launch call with
-                        // the dispatcher function.
-                        callInst->setCalledFunction(m_rpcLaunchKernel);
+                        // the dispatcher function. It also takes the number
+                        // of kernel arguments, guarded versions take one
+                        // more.
+                        IRBuilder<> builder(callInst);
+                        SmallVector<Value *, 9> args(callInst->arg_begin(),
+                                                     callInst->arg_end());
+                        args.push_back(builder.getInt32(kernelF->arg_size()));
+
+                        CallInst *newCall =
+                                    builder.CreateCall(m_rpcLaunchKernel, args);
+                        newCall->setCallingConv(
+                                        m_rpcLaunchKernel->getCallingConv());
+                        callInst->replaceAllUsesWith(newCall);
+
+                        forRemoval.push_back(callInst);
                         continue;
                     }
 
@@ -319,6 +722,11 @@ void CUDACoarseningPass::generateVersions(Function& F, bool deviceCode)
     std::vector<unsigned int> strides = {1, 2, 4, 8, 32};
     std::vector<unsigned int> dimensions = {0};
 
+    // 2D tiles (x, y) of the thread-level work.
+    std::vector<std::vector<unsigned int>> tiles = {
+        {2, 2, 1}, {4, 2, 1}, {2, 4, 1}, {4, 4, 1}
+    };
+
     CallInst *cudaRegFuncCall = cudaRegistrationCallForKernel(*F.getParent(),
                                                               F.getName());
     if(!deviceCode) {
@@ -327,15 +735,95 @@ void CUDACoarseningPass::generateVersions(Function& F, bool deviceCode)
         }
     }
 
+    // Expected sectors per warp request and bank conflicts of the
+    // thread-level versions. The analyses are rerun on every generated
+    // version, so query them up front.
+    std::map<std::pair<unsigned int, unsigned int>, double> sectors;
+    std::map<std::pair<unsigned int, unsigned int>, double> conflicts;
+    if (deviceCode) {
+        BenefitAnalysisPass *benefit = &getAnalysis<BenefitAnalysisPass>(F);
+        BankConflictAnalysisPass *bankConflicts =
+                                &getAnalysis<BankConflictAnalysisPass>(F);
+        for (auto factor : factors) {
+            for (auto stride : strides) {
+                sectors[{factor, stride}] =
+                            benefit->sectorsPerRequest(factor, stride);
+                conflicts[{factor, stride}] =
+                            bankConflicts->conflictDegree(factor, stride);
+            }
+        }
+    }
+
     for (auto dimension : dimensions) {
         for (auto factor : factors) {
+            std::vector<unsigned int> tile(CUDA_MAX_DIM, 1);
+            std::vector<unsigned int> tileStrides(CUDA_MAX_DIM, 1);
+            tile[dimension] = factor;
+
+            // Best coalesced strides first, bank conflicts break ties.
+            std::vector<unsigned int> ranked = strides;
+            bool modeled = deviceCode && dimension == 0;
+            if (modeled) {
+                std::stable_sort(ranked.begin(),
+                                 ranked.end(),
+                                 [&](unsigned int a, unsigned int b) {
+                                     return std::make_pair(
+                                                sectors[{factor, a}],
+                                                conflicts[{factor, a}]) <
+                                            std::make_pair(
+                                                sectors[{factor, b}],
+                                                conflicts[{factor, b}]);
+                                 });
+
+                errs() << "--  INFO  -- Sectors per request / bank "
+                       << "conflicts, factor " << factor << ":";
+                for (auto stride : ranked) {
+                    std::stringstream tmp;
+                    tmp << std::fixed << std::setprecision(2)
+                        << sectors[{factor, stride}] << " / "
+                        << conflicts[{factor, stride}];
+                    errs() << " " << stride << " (" << tmp.str() << ")";
+                }
+                errs() << "\n";
+            }
+
+            double bestSectors = modeled ? sectors[{factor, ranked[0]}] : 0;
+            double bestConflicts = modeled ? conflicts[{factor, 1}] : 0;
             for (auto stride : strides) {
+                if (modeled) {
+                    bestConflicts = std::min(bestConflicts,
+                                             conflicts[{factor, stride}]);
+                }
+            }
+
+            for (auto stride : ranked) {
+                if (bestSectors > 0 && CLCoarseningPruneSectors &&
+                    sectors[{factor, stride}] * 100 >
+                        bestSectors * (100 + CLCoarseningPruneSectors)) {
+                    errs() << "Thread mode factor " << factor << " stride "
+                           << stride << " not generated, uncoalesced "
+                           << "global accesses\n";
+                    remarkPrunedVersion(F, false, factor, stride,
+                                        "uncoalesced global accesses");
+                    continue;
+                }
+                if (bestConflicts > 0 && CLCoarseningPruneConflicts &&
+                    conflicts[{factor, stride}] * 100 >
+                        bestConflicts * (100 + CLCoarseningPruneConflicts)) {
+                    errs() << "Thread mode factor " << factor << " stride "
+                           << stride << " not generated, shared memory "
+                           << "bank conflicts\n";
+                    remarkPrunedVersion(F, false, factor, stride,
+                                        "shared memory bank conflicts");
+                    continue;
+                }
+                tileStrides[dimension] = stride;
                 generateVersion(F,
                                 deviceCode,
-                                factor,
-                                stride,
-                                dimension,
+                                tile,
+                                tileStrides,
                                 false, // Thread-level.
+                                false, // Not swizzled.
                                 cudaRegFuncCall);
             }
             // Make sure we do not over-duplicate shared memory!
@@ -343,55 +831,97 @@ void CUDACoarseningPass::generateVersions(Function& F, bool deviceCode)
                 m_divergentGlobals =
                             m_divergenceAnalysisBL->getDivergentGlobals(&F);
 
-                uint32_t smemSize = 0;
-                for (auto& gv : m_divergentGlobals) {
-                    SequentialType *seqType = dyn_cast<SequentialType>(
-                                                            gv->getValueType());
-                    if (seqType) {
-                        Type *elT = seqType->getArrayElementType();
-                        uint16_t elTSize =
-                           F.getParent()->getDataLayout().getTypeAllocSize(elT);
-
-                        smemSize += elTSize * seqType->getArrayNumElements();
-                    }
-                }
-
-                if (smemSize * factor >= 0xc000) { // compute_61 limit (48kB)
+                uint64_t smemSize = sharedFootprint(F, factor);
+                if (smemSize >= m_target->sharedPerBlock) {
                     errs() << "Block mode factor " << factor << " not generated "
                         << ", reached shared memory limit\n";
+                    remarkPrunedVersion(F, true, factor, 0,
+                                        "reached shared memory limit");
                     continue;
                 }
             }
 
+            // Interleaved and swizzled blocks spread the accesses of the
+            // merged blocks over the L2 cache and the memory partitions.
+            for (auto stride : strides) {
+                tileStrides[dimension] = stride;
+                generateVersion(F,
+                                deviceCode,
+                                tile,
+                                tileStrides,
+                                true,  // Block-level.
+                                false, // Not swizzled.
+                                cudaRegFuncCall);
+            }
+            tileStrides[dimension] = 1;
             generateVersion(F,
                             deviceCode,
-                            factor,
-                            1,         // Stride in block-level mode is ignored.
-                            dimension,
+                            tile,
+                            tileStrides,
                             true,      // Block-level.
+                            true,      // Swizzled.
                             cudaRegFuncCall);
         }
     }
+
+    // Guarded versions take the extent of a single dimension.
+    if (CLCoarseningGuarded) {
+        return;
+    }
+
+    for (auto& tile : tiles) {
+        generateVersion(F,
+                        deviceCode,
+                        tile,
+                        std::vector<unsigned int>(CUDA_MAX_DIM, 1),
+                        false, // Thread-level.
+                        false, // Not swizzled.
+                        cudaRegFuncCall);
+    }
+}
+
+void CUDACoarseningPass::remarkPrunedVersion(Function&    F,
+                                             bool         blockMode,
+                                             unsigned int factor,
+                                             unsigned int stride,
+                                             StringRef    reason)
+{
+    // Block-level versions are pruned for all their strides at once.
+    OptimizationRemarkEmitter ORE(&F);
+    OptimizationRemarkMissed remark(CUDA_COARSENING_REMARKS,
+                                    "VersionPruned",
+                                    &F);
+    remark << ore::NV("Mode", blockMode ? "block" : "thread")
+           << " mode factor " << ore::NV("Factor", factor);
+    if (!blockMode) {
+        remark << " stride " << ore::NV("Stride", stride);
+    }
+    remark << " not generated, " << ore::NV("Reason", reason);
+    ORE.emit(remark);
 }
 
-void CUDACoarseningPass::generateVersion(Function&     F,
-                                         bool          deviceCode,
-                                         unsigned int  factor,
-                                         unsigned int  stride,
-                                         unsigned int  dimension,
-                                         bool          blockMode,
-                                         CallInst     *cudaRegFuncCall)
+void CUDACoarseningPass::generateVersion(
+                            Function&                        F,
+                            bool                             deviceCode,
+                            const std::vector<unsigned int>& factors,
+                            const std::vector<unsigned int>& strides,
+                            bool                             blockMode,
+                            bool                             swizzled,
+                            CallInst                        *cudaRegFuncCall)
 {
     LLVMContext& ctx = F.getContext();
 
     llvm::ValueToValueMapTy vMap;
     Function *cloned = llvm::CloneFunction(&F, vMap);
     std::string kn = namedKernelVersion(F.getName(),
-                                        dimension,
-                                        blockMode ? factor : 1,
-                                        blockMode ? 1 : factor,
-                                        stride);
+                                        factors,
+                                        strides,
+                                        blockMode,
+                                        swizzled);
     cloned->setName(kn);
+    if (deviceCode && CLCoarseningGuarded) {
+        cloned = appendExtentArgument(*cloned);
+    }
     m_coarsenedKernelMap[cloned] = true;
 
     if (!deviceCode) {
@@ -446,58 +976,138 @@ void CUDACoarseningPass::generateVersion(Function&     F,
         return;
     }
     
-    unsigned int savedFactor = m_factor;
-    unsigned int savedStride = m_stride;
-    unsigned int savedDimension = m_dimension;
+    std::vector<unsigned int> savedFactors = m_factors;
+    std::vector<unsigned int> savedStrides = m_strides;
     bool savedBlockLevel = m_blockLevel;
+    bool savedSwizzle = m_swizzle;
 
-    m_factor = factor;
-    m_stride = stride;
+    m_factors = factors;
+    m_strides = strides;
     m_blockLevel = blockMode;
-    m_dimension = dimension;
-
-    analyzeKernel(*cloned);
-    scaleKernelGrid();
-    coarsenKernel(*cloned);
-    replacePlaceholders();
-
-    SmallVector<Metadata *, 3> operandsMD;
-    operandsMD.push_back(llvm::ValueAsMetadata::getConstant(cloned));
-    operandsMD.push_back(llvm::MDString::get(F.getContext(), "kernel"));
-    operandsMD.push_back(llvm::ValueAsMetadata::getConstant(
-            llvm::ConstantInt::get(llvm::Type::getInt32Ty(F.getContext()),
-                                                        1)));
-
-    llvm::NamedMDNode *nvvmMetadataNode =
-            F.getParent()->getOrInsertNamedMetadata("nvvm.annotations");
-    
-    nvvmMetadataNode->addOperand(MDTuple::get(F.getContext(),
-                                    operandsMD));
+    m_swizzle = swizzled;
 
-    m_factor = savedFactor;
-    m_stride = savedStride;
+    coarsenTile(*cloned, F);
+
+    // Versions were admitted by the footprint estimated before coarsening,
+    // the layout padding and the aliasing decide the final one. A single
+    // version over the limit fails the assembly of the whole module.
+    uint64_t smemSize = sharedUsage(*cloned);
+    if (smemSize > m_target->sharedPerBlock) {
+        errs() << "--  WARN  -- " << kn << " not generated, uses "
+               << smemSize << " B of shared memory\n";
+
+        unsigned int dimension = 0;
+        while (dimension + 1 < CUDA_MAX_DIM && factors[dimension] == 1) {
+            ++dimension;
+        }
+        remarkPrunedVersion(F,
+                            blockMode,
+                            factors[dimension],
+                            strides[dimension],
+                            "reached shared memory limit");
+        eraseVersion(*cloned);
+    }
+    else {
+        SmallVector<Metadata *, 3> operandsMD;
+        operandsMD.push_back(llvm::ValueAsMetadata::getConstant(cloned));
+        operandsMD.push_back(llvm::MDString::get(F.getContext(), "kernel"));
+        operandsMD.push_back(llvm::ValueAsMetadata::getConstant(
+                llvm::ConstantInt::get(llvm::Type::getInt32Ty(F.getContext()),
+                                                            1)));
+
+        llvm::NamedMDNode *nvvmMetadataNode =
+                F.getParent()->getOrInsertNamedMetadata("nvvm.annotations");
+
+        nvvmMetadataNode->addOperand(MDTuple::get(F.getContext(),
+                                        operandsMD));
+
+        writeCostFeatures(*cloned,
+                          std::accumulate(factors.begin(),
+                                          factors.end(),
+                                          1u,
+                                          std::multiplies<unsigned int>()));
+    }
+
+    m_factors = savedFactors;
+    m_strides = savedStrides;
     m_blockLevel = savedBlockLevel;
-    m_dimension = savedDimension;
+    m_swizzle = savedSwizzle;
 }
 
-std::string CUDACoarseningPass::namedKernelVersion(std::string kernel,
-                                                   int d, int b, int t, int s)
+void CUDACoarseningPass::eraseVersion(Function& version)
+{
+    // Annotations of the version, e.g. its launch bounds, go first, the
+    // NVPTX backend does not expect annotations of erased kernels.
+    Module& M = *version.getParent();
+    NamedMDNode *nvvmMetadataNode = M.getNamedMetadata("nvvm.annotations");
+    if (nvvmMetadataNode) {
+        std::vector<MDNode *> kept;
+        for (MDNode *node : nvvmMetadataNode->operands()) {
+            GlobalValue *entity = mdconst::dyn_extract_or_null<GlobalValue>(
+                                                        node->getOperand(0));
+            if (entity != &version) {
+                kept.push_back(node);
+            }
+        }
+
+        nvvmMetadataNode->clearOperands();
+        for (MDNode *node : kept) {
+            nvvmMetadataNode->addOperand(node);
+        }
+        clearAnnotationCache(&M);
+    }
+
+    m_coarsenedKernelMap.erase(&version);
+    version.eraseFromParent();
+}
+
+std::string CUDACoarseningPass::namedKernelVersion(
+                                    std::string                      kernel,
+                                    const std::vector<unsigned int>& factors,
+                                    const std::vector<unsigned int>& strides,
+                                    bool                             blockMode,
+                                    bool                             swizzled)
 {
     // Generate <kernel>_<dimension>_<blockfactor>_<threadfactor>_<stride> name
+    // Tiles list all their dimensions and join the values of the dimensions
+    // with 'x', e.g. <kernel>_01_1_4x2_1x1. Swizzled versions end with _sw.
     // TODO other mangling schemes
     // C code?
 
     std::string demangled = Util::demangle(kernel);
     demangled = Util::nameFromDemangled(demangled);
 
+    std::string dimensions;
+    std::string tileFactors;
+    std::string tileStrides;
+    for (unsigned int dimension = 0; dimension < CUDA_MAX_DIM; ++dimension) {
+        if (factors[dimension] == 1) {
+            continue;
+        }
+        if (!dimensions.empty()) {
+            tileFactors.append("x");
+            tileStrides.append("x");
+        }
+        dimensions.append(std::to_string(dimension));
+        tileFactors.append(std::to_string(factors[dimension]));
+        tileStrides.append(std::to_string(strides[dimension]));
+    }
+
     std::string suffix = "_";
-    suffix.append(std::to_string(d));
+    suffix.append(dimensions);
     suffix.append("_");
-    suffix.append(std::to_string(b));
+    suffix.append(blockMode ? tileFactors : "1");
     suffix.append("_");
-    suffix.append(std::to_string(t));
+    suffix.append(blockMode ? "1" : tileFactors);
     suffix.append("_");
-    suffix.append(std::to_string(s));
+    suffix.append(tileStrides);
+    if (swizzled) {
+        suffix.append("_sw");
+    }
+    if (CLCoarseningGuarded) {
+        // The runtime passes the original extent to guarded versions.
+        suffix.append("_g");
+    }
 
     std::string name = "_Z";
     name.append(std::to_string(demangled.length() + suffix.length()));
@@ -511,15 +1121,108 @@ std::string CUDACoarseningPass::namedKernelVersion(std::string kernel,
     return name;
 }
 
+void CUDACoarseningPass::coarsenTile(Function& F, Function& original)
+{
+    // The dimensions of the tile are coarsened one after the other. The
+    // replicas of a dimension are replicated again along the next one, so
+    // that each thread (block) ends up with the whole tile of work.
+    std::string savedAnalysisDimension = CLCoarseningDimension;
+    unsigned int savedFactor = m_factor;
+    unsigned int savedStride = m_stride;
+    unsigned int savedDimension = m_dimension;
+    bool savedSwizzle = m_swizzle;
+    Function *bounds = &original;
+
+    for (unsigned int dimension = 0; dimension < CUDA_MAX_DIM; ++dimension) {
+        if (m_factors[dimension] == 1) {
+            continue;
+        }
+
+        m_factor = m_factors[dimension];
+        m_stride = m_strides[dimension];
+        m_dimension = dimension;
+
+        // The analyses follow the coarsened dimension.
+        CLCoarseningDimension = Util::dimensionToString(dimension);
+
+        analyzeKernel(F);
+        unsigned int instsBefore = F.getInstructionCount();
+        unsigned int replicatedInsts = 0;
+        unsigned int replicatedRegions = 0;
+        unsigned int placeholders = 0;
+        if (!isGridStrideKernel()) {
+            normalizeEarlyExits(F);
+            refineDivergence();
+            scaleKernelGrid();
+            coarsenKernel(F);
+
+            replicatedInsts = m_coarseningMap.size();
+            replicatedRegions = m_blockLevel ?
+                    m_divergenceAnalysisBL->getOutermostRegions().size() :
+                    m_divergenceAnalysisTL->getOutermostRegions().size();
+            for (auto& ph : m_phMap) {
+                placeholders += ph.second.size();
+            }
+
+            replacePlaceholders();
+            stageReplicas(F, *bounds);
+            eliminateRedundantLoads(F);
+            vectorizeReplicas(F);
+            scheduleReplicas(F);
+            prefetchReplicas(F);
+            guardReplicas(F);
+            layoutSharedReplicas(F);
+        }
+
+        scaleLaunchBounds(*bounds, F);
+        bounds = &F;
+
+        OptimizationRemarkEmitter ORE(&F);
+        ORE.emit(OptimizationRemark(CUDA_COARSENING_REMARKS, "Coarsened", &F)
+                 << "coarsened " << ore::NV("Kernel", original.getName())
+                 << " in dimension " << ore::NV("Dimension", dimension)
+                 << " at " << ore::NV("Mode",
+                                      m_blockLevel ? "block" : "thread")
+                 << " level, factor " << ore::NV("Factor", m_factor)
+                 << ", stride " << ore::NV("Stride", m_stride) << ": "
+                 << ore::NV("ReplicatedInstructions", replicatedInsts)
+                 << " instructions and "
+                 << ore::NV("ReplicatedRegions", replicatedRegions)
+                 << " regions replicated, "
+                 << ore::NV("Placeholders", placeholders)
+                 << " placeholders, "
+                 << ore::NV("InstructionsBefore", instsBefore) << " -> "
+                 << ore::NV("InstructionsAfter", F.getInstructionCount())
+                 << " instructions");
+
+        // Only the first dimension is swizzled, swizzling the next one by
+        // the first would no longer be a permutation of the blocks.
+        m_swizzle = false;
+    }
+
+    aliasSharedArrays(F);
+
+    CLCoarseningDimension = savedAnalysisDimension;
+    m_factor = savedFactor;
+    m_stride = savedStride;
+    m_dimension = savedDimension;
+    m_swizzle = savedSwizzle;
+}
+
 void CUDACoarseningPass::analyzeKernel(Function& F)
 {
     m_coarseningMap.clear();
     m_phMap.clear();
     m_phReplacementMap.clear();
+    m_replicaRegions.clear();
+    m_earlyExits.clear();
+    m_globalsCoarseningMap.clear();
 
     // Perform initial analysis.
     m_benefitAnalysis = &getAnalysis<BenefitAnalysisPass>(F);
     m_benefitAnalysis->printStatistics();
+    m_target = &getTargetDescription(F);
+    getAnalysis<BankConflictAnalysisPass>(F).printStatistics();
 
     m_loopInfo = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
     m_postDomT = &getAnalysis<PostDominatorTreeWrapperPass>(F).getPostDomTree();
@@ -543,13 +1246,12 @@ void CUDACoarseningPass::scaleGrid(BasicBlock *configBlock,
         uint8_t scaleGrid[CUDA_MAX_DIM];
         uint8_t scaleBlock[CUDA_MAX_DIM];
 
-        scaleGrid[0] = ((m_dimension == 0) && m_blockLevel) ? m_factor : 1;
-        scaleGrid[1] = ((m_dimension == 1) && m_blockLevel) ? m_factor : 1;
-        scaleGrid[2] = ((m_dimension == 2) && m_blockLevel) ? m_factor : 1;
-
-        scaleBlock[0] = ((m_dimension == 0) && !m_blockLevel) ? m_factor : 1;
-        scaleBlock[1] = ((m_dimension == 1) && !m_blockLevel) ? m_factor : 1;
-        scaleBlock[2] = ((m_dimension == 2) && !m_blockLevel) ? m_factor : 1;
+        for (unsigned int dimension = 0;
+             dimension < CUDA_MAX_DIM;
+             ++dimension) {
+            scaleGrid[dimension] = m_blockLevel ? m_factors[dimension] : 1;
+            scaleBlock[dimension] = m_blockLevel ? 1 : m_factors[dimension];
+        }
 
         args.push_back(builder.getInt8(scaleGrid[0])); // scale grid X
         args.push_back(builder.getInt8(scaleGrid[1])); // scale grid Y
@@ -557,6 +1259,10 @@ void CUDACoarseningPass::scaleGrid(BasicBlock *configBlock,
         args.push_back(builder.getInt8(scaleBlock[0])); // scale block X
         args.push_back(builder.getInt8(scaleBlock[1])); // scale block Y
         args.push_back(builder.getInt8(scaleBlock[2])); // scale block Z
+
+        if (CLCoarseningGuarded) {
+            args[5] = appendExtentToArgs(configCall);
+        }
     }
     else {
         llvm::CallInst *regFunc = cudaRegistrationCallForKernel(
@@ -586,6 +1292,61 @@ void CUDACoarseningPass::scaleGrid(BasicBlock *configBlock,
     }
 }
 
+Value *CUDACoarseningPass::appendExtentToArgs(CallInst *configCall)
+{
+    // Kernel arguments are passed as an array of pointers to them. Guarded
+    // kernels take the original extent of the coarsened dimension as the
+    // last argument.
+    Function *stub = configCall->getFunction();
+    Module& M = *stub->getParent();
+    unsigned int count = stub->arg_size();
+
+    IRBuilder<> builder(configCall);
+    Value *dimXY = configCall->getArgOperand(m_blockLevel ? 1 : 3);
+    Value *extent = configCall->getArgOperand(m_blockLevel ? 2 : 4);
+    if (m_dimension == 0) {
+        extent = builder.CreateTrunc(dimXY, builder.getInt32Ty());
+    }
+    else if (m_dimension == 1) {
+        extent = builder.CreateTrunc(builder.CreateLShr(dimXY, 32),
+                                     builder.getInt32Ty());
+    }
+
+    IRBuilder<> entryBuilder(&*stub->getEntryBlock().getFirstInsertionPt());
+    AllocaInst *extentArg = CreateAlignedAlloca(M,
+                                                &entryBuilder,
+                                                builder.getInt32Ty(),
+                                                4,
+                                                "extent");
+    AllocaInst *guardedArgs = CreateAlignedAlloca(
+                              M,
+                              &entryBuilder,
+                              ArrayType::get(builder.getInt8PtrTy(), count + 1),
+                              8,
+                              "guarded_args");
+
+    builder.CreateAlignedStore(extent, extentArg, 4, false);
+
+    Value *args = configCall->getArgOperand(5);
+    for (unsigned int index = 0; index < count; ++index) {
+        Value *arg = builder.CreateAlignedLoad(
+                            builder.CreateConstInBoundsGEP1_64(args, index), 8);
+        builder.CreateAlignedStore(
+                    arg,
+                    builder.CreateConstInBoundsGEP2_64(guardedArgs, 0, index),
+                    8,
+                    false);
+    }
+    builder.CreateAlignedStore(
+                    builder.CreatePointerCast(extentArg,
+                                              builder.getInt8PtrTy()),
+                    builder.CreateConstInBoundsGEP2_64(guardedArgs, 0, count),
+                    8,
+                    false);
+
+    return builder.CreateConstInBoundsGEP2_64(guardedArgs, 0, 0);
+}
+
 void CUDACoarseningPass::insertRPCFunctions(Module& M)
 {
     m_rpcLaunchKernel = nullptr;
@@ -632,7 +1393,8 @@ void CUDACoarseningPass::insertRPCLaunchKernel(Module& M)
             Type::getInt32Ty(ctx),   // blockZ
             origFT->getParamType(5), // args
             origFT->getParamType(6), // sharedMemory
-            origFT->getParamType(7)  // cudaStream
+            origFT->getParamType(7), // cudaStream
+            Type::getInt32Ty(ctx)    // argCount
         );
 
         ptrF = cast<Function>(scaled.getCallee());
@@ -718,6 +1480,32 @@ void CUDACoarseningPass::insertRPCLaunchKernel(Module& M)
     builder.CreateAlignedStore(argSharedMem, localSharedMemory, 8, false);
     builder.CreateAlignedStore(argCudaStream, localCudaStream, 8, false);
 
+    // Guarded kernels check the replicas against the original extent, so
+    // the grid is rounded up instead of down: to whole 'factor * stride'
+    // tiles of 'stride' threads (blocks) each, which covers every element.
+    unsigned int stride = m_stride;
+    auto scaleDown = [&builder, stride](Value *value, Value *scale) -> Value * {
+        Value *divisor = builder.CreateIntCast(scale,
+                                               builder.getInt32Ty(),
+                                               false);
+        if (!CLCoarseningGuarded) {
+            return builder.CreateUDiv(value, divisor);
+        }
+
+        Value *tile = builder.CreateMul(divisor, builder.getInt32(stride));
+        Value *tiles = builder.CreateUDiv(
+                              builder.CreateAdd(value,
+                                                builder.CreateSub(
+                                                        tile,
+                                                        builder.getInt32(1))),
+                              tile);
+        Value *scaled = builder.CreateMul(tiles, builder.getInt32(stride));
+        return builder.CreateSelect(
+                            builder.CreateICmpEQ(divisor, builder.getInt32(1)),
+                            value,
+                            scaled);
+    };
+
     // Scale grid X
     Value *ptrGridX = builder.CreatePointerCast(localGridXY,
                                                 Type::getInt32PtrTy(ctx));
@@ -725,11 +1513,7 @@ void CUDACoarseningPass::insertRPCLaunchKernel(Module& M)
                                          ConstantInt::get(builder.getInt64Ty(),
                                                           0));
     Value *valGridX = builder.CreateAlignedLoad(ptrGridX, 4);
-    Value *valScaledGridX = 
-        builder.CreateUDiv(valGridX,
-                           builder.CreateIntCast(argScaleGridX,
-                                                 builder.getInt32Ty(),
-                                                 false));
+    Value *valScaledGridX = scaleDown(valGridX, argScaleGridX);
     builder.CreateAlignedStore(valScaledGridX, ptrGridX, 4, false);
 
     // Scale grid Y
@@ -739,20 +1523,12 @@ void CUDACoarseningPass::insertRPCLaunchKernel(Module& M)
                                          ConstantInt::get(builder.getInt64Ty(),
                                                           1));
     Value *valGridY = builder.CreateAlignedLoad(ptrGridY, 4);
-    Value *valScaledGridY = 
-        builder.CreateUDiv(valGridY,
-                           builder.CreateIntCast(argScaleGridY,
-                                                 builder.getInt32Ty(),
-                                                 false));
+    Value *valScaledGridY = scaleDown(valGridY, argScaleGridY);
     builder.CreateAlignedStore(valScaledGridY, ptrGridY, 4, false);
 
     // Scale grid Z
     Value *valGridZ = builder.CreateAlignedLoad(localGridZ, 8);
-    Value *valScaledGridZ = 
-        builder.CreateUDiv(valGridZ,
-                           builder.CreateIntCast(argScaleGridZ,
-                                                 builder.getInt32Ty(),
-                                                 false));
+    Value *valScaledGridZ = scaleDown(valGridZ, argScaleGridZ);
     builder.CreateAlignedStore(valScaledGridZ, localGridZ, 8, false);
 
     // Scale BLOCK X
@@ -762,11 +1538,7 @@ void CUDACoarseningPass::insertRPCLaunchKernel(Module& M)
                                           ConstantInt::get(builder.getInt64Ty(),
                                                            0));
     Value *valBlockX = builder.CreateAlignedLoad(ptrBlockX, 4);
-    Value *valScaledBlockX = 
-        builder.CreateUDiv(valBlockX,
-                           builder.CreateIntCast(argScaleBlockX,
-                                                 builder.getInt32Ty(),
-                                                 false));
+    Value *valScaledBlockX = scaleDown(valBlockX, argScaleBlockX);
     builder.CreateAlignedStore(valScaledBlockX, ptrBlockX, 4, false);
 
     // Scale BLOCK Y
@@ -776,20 +1548,12 @@ void CUDACoarseningPass::insertRPCLaunchKernel(Module& M)
                                           ConstantInt::get(builder.getInt64Ty(),
                                                            1));
     Value *valBlockY = builder.CreateAlignedLoad(ptrBlockY, 4);
-    Value *valScaledBlockY = 
-        builder.CreateUDiv(valBlockY,
-                           builder.CreateIntCast(argScaleBlockY,
-                                                 builder.getInt32Ty(),
-                                                 false));
+    Value *valScaledBlockY = scaleDown(valBlockY, argScaleBlockY);
     builder.CreateAlignedStore(valScaledBlockY, ptrBlockY, 4, false);
 
     // Scale BLOCK Z
     Value *valBlockZ = builder.CreateAlignedLoad(localBlockZ, 8);
-    Value *valScaledBlockZ = 
-        builder.CreateUDiv(valBlockZ,
-                           builder.CreateIntCast(argScaleBlockZ,
-                                                 builder.getInt32Ty(),
-                                                 false));
+    Value *valScaledBlockZ = scaleDown(valBlockZ, argScaleBlockZ);
     builder.CreateAlignedStore(valScaledBlockZ, localBlockZ, 8, false);
 
     Value *c_localPtr = builder.CreateAlignedLoad(localFuncPtr, 8, "c_ptr");
@@ -852,6 +1616,26 @@ void CUDACoarseningPass::insertRPCRegisterFunction(Module& M)
 }
 
 // PRIVATE ACCESSORS
+bool CUDACoarseningPass::isGridStrideKernel() const
+{
+    if (!CLCoarseningGridStride) {
+        return false;
+    }
+
+    if (!m_gridAnalysis->isGridStrideKernel(m_dimension)) {
+        return false;
+    }
+
+    // The step of a grid-stride loop reads blockDim and gridDim at run time,
+    // so the loop covers the whole iteration space for any launch
+    // configuration. Launching fewer threads (blocks) makes each of them
+    // execute factor-times more iterations, the kernel body stays untouched.
+    errs() << "--  INFO  -- Grid-stride loop kernel, coarsening by grid "
+           << "reduction only\n";
+
+    return true;
+}
+
 bool CUDACoarseningPass::shouldCoarsen(Function& F, bool hostCode) const
 {
     if (m_coarsenedKernelMap.find(&F) != m_coarsenedKernelMap.end()) {
@@ -875,7 +1659,10 @@ bool CUDACoarseningPass::shouldCoarsen(Function& F, bool hostCode) const
         }
     }
 
-    return Util::shouldCoarsen(F, m_kernelName, hostCode, m_dynamicMode);
+    return Util::shouldCoarsen(F,
+                               m_kernelName,
+                               hostCode,
+                               m_dynamicMode || m_autoMode);
 }
 
 CallInst *
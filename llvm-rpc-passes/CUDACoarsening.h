@@ -14,16 +14,56 @@ using namespace llvm;
 
 typedef std::unordered_map<Function *, bool> coarsenedKernelMap_t;
 
+// Early exit of a kernel, normalized into per-replica active masks.
+struct EarlyExit {
+    BasicBlock *block;     // Block the exit branched off.
+    Value      *condition; // Condition of the exit branch.
+    bool        onTrue;    // Exit taken if and only if 'condition' is true.
+};
+
+// Live range of a shared array in the barrier-delimited phases of a kernel,
+// see 'aliasSharedArrays'.
+struct SharedRange {
+    GlobalVariable *gv;
+    uint64_t        size;      // Bytes, including the replicas.
+    uint64_t        alignment;
+    unsigned int    first;     // First phase the array is accessed in.
+    unsigned int    last;      // Last phase the array is accessed in.
+    uint64_t        offset;    // Offset in the shared memory pool.
+};
+
+// Layout of the replicas of a divergent shared array, see
+// 'layoutSharedReplicas'.
+enum SharedLayout {
+    SHARED_SEPARATE,     // One array per replica.
+    SHARED_CONCATENATED, // One array holding the replicas one after another.
+    SHARED_INTERLEAVED   // One array holding the elements of the replicas
+                         // one after another, optionally padded.
+};
+
+// Coarsening of a kernel chosen in auto mode, see 'selectConfig'.
+struct CoarseningConfig {
+    bool         blockLevel;
+    unsigned int dimension;
+    unsigned int factor;
+    unsigned int stride;
+};
+
 namespace llvm {
+    class AtomicRMWInst;
+    class DataLayout;
+    class ScalarEvolution;
     class LoopInfo;
     class PostDominatorTree;
     class DominatorTree;
 }
 
+class DivergenceAnalysisPass;
 class DivergenceAnalysisPassTL;
 class DivergenceAnalysisPassBL;
 class GridAnalysisPass;
 class BenefitAnalysisPass;
+struct targetDescription;
 
 class CUDACoarseningPass : public ModulePass {
   public:
@@ -45,30 +85,81 @@ class CUDACoarseningPass : public ModulePass {
     bool handleHostCode(Module& M);
 
     void generateVersions(Function& F, bool deviceCode);
-    void generateVersion(Function&     F,
-                         bool          deviceCode,
-                         unsigned int  factor,
-                         unsigned int  stride,
-                         unsigned int  dimension,
-                         bool          blockMode,
-                         CallInst     *cudaRegFuncCall);
-    std::string namedKernelVersion(std::string kernel, int d, int b, int t, int s);
+    void generateVersion(Function&                        F,
+                         bool                             deviceCode,
+                         const std::vector<unsigned int>& factors,
+                         const std::vector<unsigned int>& strides,
+                         bool                             blockMode,
+                         bool                             swizzled,
+                         CallInst                        *cudaRegFuncCall);
+    void remarkPrunedVersion(Function&    F,
+                             bool         blockMode,
+                             unsigned int factor,
+                             unsigned int stride,
+                             StringRef    reason);
+    void eraseVersion(Function& version);
+    std::string namedKernelVersion(std::string                      kernel,
+                                   const std::vector<unsigned int>& factors,
+                                   const std::vector<unsigned int>& strides,
+                                   bool                             blockMode,
+                                   bool                             swizzled);
     
+    bool selectConfig(Function& F, CoarseningConfig& config);
+    void applyConfig(const CoarseningConfig& config);
+    void writeConfig(Function& F, const CoarseningConfig& config);
+    bool readConfigs();
+
+    void coarsenTile(Function& F, Function& original);
     void analyzeKernel(Function& F);
+    void writeCostFeatures(Function& F, unsigned int work);
     void scaleKernelGrid();
     void scaleKernelGridSizes(unsigned int dimension);
     void scaleKernelGridIDs(unsigned int dimension);
+    Value *swizzleBlockID(Value *id, Instruction *insertBefore);
+    void scaleLaunchBounds(Function& F, Function& version);
     void scaleGrid(BasicBlock  *configBlock,
                    CallInst    *configCall,
                    std::string  kernelName);
+    Value *appendExtentToArgs(CallInst *configCall);
+
+    void normalizeEarlyExits(Function& F);
+
+    Function *appendExtentArgument(Function& F);
+    void guardReplicas(Function& F);
+    bool guardRegion(DivergentRegion *region, Value *valid);
 
+    void refineDivergence();
     void coarsenKernel(Function& F);
     void replacePlaceholders();
+    void stageReplicas(Function& F, Function& bounds);
+    void eliminateRedundantLoads(Function& F);
+    void vectorizeReplicas(Function& F);
+    bool vectorizeAccesses(InstVector&       chunk,
+                           ScalarEvolution  *SE,
+                           const DataLayout& DL);
+    void scheduleReplicas(Function& F);
+    void prefetchReplicas(Function& F);
+
+    void findTreeReductions(Function& F);
+    void preReduceStore(StoreInst *seed, unsigned int opcode);
 
     void replicateInstruction(Instruction *inst);
+    bool aggregateAtomic(AtomicRMWInst *atomic);
     void replicateGlobal(GlobalVariable *gv);
+    void layoutSharedReplicas(Function& F);
+    bool findSharedRanges(Function& F, std::vector<SharedRange>& ranges);
+    uint64_t sharedFootprint(Function& F, unsigned int factor);
+    uint64_t sharedUsage(Function& F);
+    void aliasSharedArrays(Function& F);
     void replicateRegion(DivergentRegion *region);
     void replicateRegionClassic(DivergentRegion *region);
+    void replicateLoopFused(DivergentRegion *region);
+    void replicateRegionAtBarrier(DivergentRegion *region,
+                                  Instruction     *barrier);
+
+    void mergeRegions();
+    void mergeRegion(DivergentRegion        *region,
+                     DivergenceAnalysisPass *divergence);
 
     void replicateRegionImpl(DivergentRegion *region, CoarseningMap& aliveMap);
 
@@ -90,6 +181,41 @@ class CUDACoarseningPass : public ModulePass {
     void insertRPCRegisterFunction(Module& M);
 
     // PRIVATE ACCESSORS
+    bool isMergeable(DivergentRegion *region) const;
+      // Returns true if and only if the 'region' is a small if-then(-else)
+      // whose sides can be speculated, see 'mergeRegions'.
+
+    bool hasReplicaGuards() const;
+      // Returns true if and only if the replicas of the coarsened kernel are
+      // guarded by the grid extent or by early exit masks. Replicas must not
+      // be combined then, as each of them runs under its own condition.
+
+    bool recordsReplicaRegions() const;
+      // Returns true if and only if the replicated regions are recorded in
+      // 'm_replicaRegions', to be guarded or prefetched once coarsened.
+
+    bool isUniformAddress(Value             *pointer,
+                          const DataLayout&  layout) const;
+      // Returns true if and only if the 'pointer' is the same in all the
+      // replicas of a coarsened thread (block).
+
+    bool isReductionRegion(DivergentRegion *region) const;
+      // Returns true if and only if the 'region' only performs statements
+      // of a pre-reduced tree reduction, which are not replicated.
+
+    Instruction *findSplitBarrier(DivergentRegion *region) const;
+      // Returns the first barrier of the 'region' the region can be split
+      // at, so that the barrier is not replicated, or null if none.
+
+    bool isFusibleLoop(DivergentRegion *region) const;
+      // Returns true if and only if the 'region' is a single-block loop
+      // whose replicas can be fused into one loop, see 'replicateLoopFused'.
+
+    bool isGridStrideKernel() const;
+      // Returns true if and only if the analyzed kernel only uses the grid
+      // built-ins of the coarsened dimension to drive grid-stride loops, and
+      // can thus be coarsened by the host-side grid scaling alone.
+
     bool shouldCoarsen(Function& F, bool hostCode = false) const;
       // Returns true if and only if this function is to be coarsened according
       // to the current pass configuration.
@@ -108,12 +234,18 @@ class CUDACoarseningPass : public ModulePass {
     DivergenceAnalysisPassBL *m_divergenceAnalysisBL;
     GridAnalysisPass       *m_gridAnalysis;
     BenefitAnalysisPass    *m_benefitAnalysis;
+    const targetDescription *m_target;
 
     CoarseningMap           m_coarseningMap;
     CoarseningMap           m_phMap;
     Map                     m_phReplacementMap;
     GlobalsSet              m_divergentGlobals;
     GlobalsCMap             m_globalsCoarseningMap;
+    InstSet                 m_reductionInsts;
+    std::map<StoreInst *, unsigned int> m_reductionSeeds;
+    std::vector<std::pair<std::unique_ptr<DivergentRegion>,
+                          unsigned int>> m_replicaRegions;
+    std::vector<EarlyExit>  m_earlyExits;
 
     Function               *m_rpcLaunchKernel;
     Function               *m_rpcRegisterFunction;
@@ -121,14 +253,19 @@ class CUDACoarseningPass : public ModulePass {
     Function               *m_readEnvConfig;
 
     coarsenedKernelMap_t    m_coarsenedKernelMap;
+    std::map<std::string, CoarseningConfig> m_autoConfigs;
 
     // CL config
     std::string             m_kernelName;
     unsigned int            m_factor;
     unsigned int            m_stride;
     bool                    m_blockLevel;
+    bool                    m_swizzle;
     bool                    m_dynamicMode;
+    bool                    m_autoMode;
     unsigned int            m_dimension;
+    std::vector<unsigned int> m_factors;
+    std::vector<unsigned int> m_strides;
 };
 
 #endif
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include <llvm/Pass.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/Analysis/ValueTracking.h>
 
 #include "Common.h"
 #include "CUDACoarsening.h"
@@ -18,6 +20,9 @@
 #include "DivergenceAnalysisPass.h"
 #include "GridAnalysisPass.h"
 
+extern cl::opt<bool> CLCoarseningAffine;
+extern cl::opt<bool> CLCoarseningAggregateAtomics;
+
 Instruction *getAddInstNSW(Value *firstValue, Value *secondValue) {
     Instruction *add =
         BinaryOperator::Create(Instruction::Add, firstValue, secondValue);
@@ -26,9 +31,62 @@ Instruction *getAddInstNSW(Value *firstValue, Value *secondValue) {
     return add;
 }
 
+Value *combineAtomicOperands(IRBuilder<>&         builder,
+                             AtomicRMWInst::BinOp  op,
+                             Value                *first,
+                             Value                *second)
+{
+    switch (op) {
+      case AtomicRMWInst::Add:
+      case AtomicRMWInst::Sub:
+        return builder.CreateAdd(first, second);
+      case AtomicRMWInst::FAdd:
+        return builder.CreateFAdd(first, second);
+      case AtomicRMWInst::And:
+        return builder.CreateAnd(first, second);
+      case AtomicRMWInst::Or:
+        return builder.CreateOr(first, second);
+      case AtomicRMWInst::Xor:
+        return builder.CreateXor(first, second);
+      case AtomicRMWInst::Max:
+        return builder.CreateSelect(builder.CreateICmpSGT(first, second),
+                                    first, second);
+      case AtomicRMWInst::Min:
+        return builder.CreateSelect(builder.CreateICmpSLT(first, second),
+                                    first, second);
+      case AtomicRMWInst::UMax:
+        return builder.CreateSelect(builder.CreateICmpUGT(first, second),
+                                    first, second);
+      case AtomicRMWInst::UMin:
+        return builder.CreateSelect(builder.CreateICmpULT(first, second),
+                                    first, second);
+      default:
+        assert(0 && "combineAtomicOperands(): Unsupported operation");
+        return nullptr;
+    }
+}
+
+
+void CUDACoarseningPass::refineDivergence()
+{
+    // Values equal in all the replicas need not be replicated.
+    if (!CLCoarseningAffine) {
+        return;
+    }
+
+    if (m_blockLevel) {
+        m_divergenceAnalysisBL->refineAffine(m_factor, m_stride);
+    }
+    else {
+        m_divergenceAnalysisTL->refineAffine(m_factor, m_stride);
+    }
+}
 
 void CUDACoarseningPass::coarsenKernel(Function& F)
 {
+    mergeRegions();
+    findTreeReductions(F);
+
     RegionVector& regions = m_blockLevel ?
                             m_divergenceAnalysisBL->getOutermostRegions() :
                             m_divergenceAnalysisTL->getOutermostRegions();
@@ -48,6 +106,14 @@ void CUDACoarseningPass::coarsenKernel(Function& F)
 
     // Replicate instructions.
     for(InstVector::iterator it = insts.begin(); it != insts.end(); ++it) {
+        if (m_reductionInsts.count(*it)) {
+            continue;
+        }
+        StoreInst *store = dyn_cast<StoreInst>(*it);
+        if (store && m_reductionSeeds.count(store)) {
+            preReduceStore(store, m_reductionSeeds[store]);
+            continue;
+        }
         replicateInstruction(*it);
     }
 
@@ -76,6 +142,12 @@ void CUDACoarseningPass::replacePlaceholders()
 
 void CUDACoarseningPass::replicateInstruction(Instruction *inst)
 {
+    if (AtomicRMWInst *atomic = dyn_cast<AtomicRMWInst>(inst)) {
+        if (aggregateAtomic(atomic)) {
+            return;
+        }
+    }
+
     InstVector current;
     current.reserve(m_factor - 1);
     Instruction *bookmark = inst;
@@ -97,6 +169,111 @@ void CUDACoarseningPass::replicateInstruction(Instruction *inst)
     updatePlaceholderMap(inst, current);
 }
 
+bool CUDACoarseningPass::isUniformAddress(Value             *pointer,
+                                          const DataLayout&  layout) const
+{
+    if (Instruction *inst = dyn_cast<Instruction>(pointer)) {
+        DivergenceAnalysisPass *divergence = m_blockLevel ?
+                             (DivergenceAnalysisPass *) m_divergenceAnalysisBL :
+                             (DivergenceAnalysisPass *) m_divergenceAnalysisTL;
+        return m_coarseningMap.find(inst) == m_coarseningMap.end() &&
+               !divergence->isDivergent(inst);
+    }
+
+    // Shared memory is replicated with the blocks.
+    if (m_blockLevel) {
+        Value *object = GetUnderlyingObject(pointer, layout);
+        if (GlobalVariable *gv = dyn_cast<GlobalVariable>(object)) {
+            return m_divergentGlobals.find(gv) == m_divergentGlobals.end();
+        }
+    }
+    return true;
+}
+
+bool CUDACoarseningPass::aggregateAtomic(AtomicRMWInst *atomic)
+{
+    // The replicas of an atomic to the same address are combined into
+    // a single atomic, e.g. 'factor' atomicAdd(counter, v) become one
+    // atomicAdd(counter, v + v.cf2 + ...). Old values the replicas read are
+    // reconstructed from the one read, as if the replicas ran in order.
+    if (!CLCoarseningAggregateAtomics || hasReplicaGuards() ||
+        atomic->isVolatile() ||
+        !isUniformAddress(atomic->getPointerOperand(),
+                          atomic->getModule()->getDataLayout())) {
+        return false;
+    }
+
+    AtomicRMWInst::BinOp op = atomic->getOperation();
+    switch (op) {
+      case AtomicRMWInst::Add:
+      case AtomicRMWInst::Sub:
+      case AtomicRMWInst::FAdd:
+        break;
+      case AtomicRMWInst::And:
+      case AtomicRMWInst::Or:
+      case AtomicRMWInst::Xor:
+      case AtomicRMWInst::Max:
+      case AtomicRMWInst::Min:
+      case AtomicRMWInst::UMax:
+      case AtomicRMWInst::UMin:
+        if (!atomic->use_empty()) {
+            return false;
+        }
+        break;
+      default:
+        return false;
+    }
+
+    // Operands of the replicas.
+    std::vector<Value *> values(1, atomic->getValOperand());
+    for (unsigned int index = 0; index < m_factor - 1; ++index) {
+        Value *value = atomic->getValOperand();
+        if (Instruction *inst = dyn_cast<Instruction>(value)) {
+            Instruction *coarsened =
+                                getCoarsenedInstruction(atomic, inst, index);
+            if (coarsened) {
+                value = coarsened;
+            }
+        }
+        values.push_back(value);
+    }
+
+    IRBuilder<> builder(atomic);
+    Value *combined = values[0];
+    std::vector<Value *> partial;
+    for (unsigned int index = 1; index < m_factor; ++index) {
+        partial.push_back(combined);
+        combined = combineAtomicOperands(builder, op, combined, values[index]);
+    }
+    atomic->setOperand(1, combined);
+
+    if (atomic->use_empty()) {
+        return true;
+    }
+
+    InstVector current;
+    builder.SetInsertPoint(atomic->getNextNode());
+    for (unsigned int index = 0; index < m_factor - 1; ++index) {
+        Value *old = nullptr;
+        if (op == AtomicRMWInst::FAdd) {
+            old = builder.CreateFAdd(atomic, partial[index]);
+        }
+        else if (op == AtomicRMWInst::Sub) {
+            old = builder.CreateSub(atomic, partial[index]);
+        }
+        else {
+            old = builder.CreateAdd(atomic, partial[index]);
+        }
+        Util::renameValueWithFactor(old, atomic->getName(), index);
+        current.push_back(cast<Instruction>(old));
+    }
+    m_coarseningMap.insert(
+                    std::pair<Instruction *, InstVector>(atomic, current));
+
+    updatePlaceholderMap(atomic, current);
+    return true;
+}
+
 void CUDACoarseningPass::replicateGlobal(GlobalVariable *gv)
 {
   for (unsigned int index = 0; index < m_factor - 1; ++index) {
@@ -10,6 +10,7 @@
 #include <functional>
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <cxxabi.h>
 #include <stdlib.h>
 #include <iomanip>
@@ -26,6 +27,7 @@ namespace llvm {
     class WeakTrackingVH;
     class PHINode;
     class GlobalVariable;
+    class Loop;
 }
 
 class DivergentRegion;
@@ -51,6 +53,8 @@ typedef std::set<llvm::BranchInst *> BranchSet;
 
 typedef std::vector<DivergentRegion *> RegionVector;
 
+typedef std::vector<llvm::Loop *> LoopVector;
+
 typedef std::map<llvm::Instruction *, InstVector> CoarseningMap;
 
 typedef std::vector<llvm::PHINode *> PhiVector;
@@ -0,0 +1,325 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Instruction cost model of the benefit analysis
+// ============================================================================
+
+#include <fstream>
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+#include "BankConflictAnalysisPass.h"
+#include "CostModel.h"
+#include "TargetDescription.h"
+
+using namespace llvm;
+
+extern cl::opt<std::string> CLCoarseningCostFeatures;
+
+std::string costTypeName(Type *type)
+{
+    // Scalar type of the key, empty if the type does not take part in it.
+    type = type->getScalarType();
+    if (type->isPointerTy()) {
+        return "ptr";
+    }
+    if (!type->isIntegerTy() && !type->isFloatingPointTy()) {
+        return "";
+    }
+
+    std::string name;
+    raw_string_ostream os(name);
+    type->print(os);
+    return os.str();
+}
+
+std::string costAddressSpace(Value *pointer, const DataLayout& DL)
+{
+    // Generic pointers are resolved through the object they point to.
+    unsigned int addressSpace = pointer->getType()->getPointerAddressSpace();
+    if (addressSpace == 0) {
+        Value *object = GetUnderlyingObject(pointer, DL);
+        if (isa<AllocaInst>(object)) {
+            return "local";
+        }
+        if (GlobalVariable *gv = dyn_cast<GlobalVariable>(object)) {
+            addressSpace = gv->getType()->getAddressSpace();
+        }
+        if (addressSpace == 0) {
+            return "generic";
+        }
+    }
+
+    switch (addressSpace) {
+        case 1:  return "global";
+        case 3:  return "shared";
+        case 4:  return "constant";
+        case 5:  return "local";
+        default: return "generic";
+    }
+}
+
+bool isMathFunction(StringRef name)
+{
+    static const std::vector<std::string> intrinsics = {
+        "sqrt", "sin", "cos", "exp", "exp2", "log", "log2", "log10", "pow"
+    };
+
+    if (name.startswith("__nv_")) {
+        return true;
+    }
+    for (const std::string& intrinsic : intrinsics) {
+        if (name.startswith("llvm." + intrinsic + ".")) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// PUBLIC CONSTRUCTORS
+CostModel::CostModel()
+{
+    reset(*findTargetDescription(CUDA_DEFAULT_TARGET));
+}
+
+// PUBLIC ACCESSORS
+double CostModel::getCost(Instruction *inst) const
+{
+    return m_costs.at(getKey(inst)) * getElements(inst);
+}
+
+std::string CostModel::getKey(Instruction *inst) const
+{
+    for (const std::string& key : candidateKeys(inst)) {
+        if (m_costs.count(key)) {
+            return key;
+        }
+    }
+    return "default";
+}
+
+std::string CostModel::getFeatureKey(Instruction *inst) const
+{
+    return candidateKeys(inst).front();
+}
+
+unsigned int CostModel::getElements(Instruction *inst) const
+{
+    Type *type = inst->getType();
+    if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+        type = store->getValueOperand()->getType();
+    }
+
+    VectorType *vectorType = dyn_cast<VectorType>(type);
+    return vectorType ? vectorType->getNumElements() : 1;
+}
+
+uint64_t CostModel::executionCount(Instruction     *inst,
+                                   LoopInfo        *LI,
+                                   ScalarEvolution *SE)
+{
+    // Each enclosing loop multiplies the executions by its trip count, as
+    // long as it is known at the compile time.
+    BasicBlock *parent = inst->getParent();
+    Loop *loop = LI->getLoopFor(parent);
+    uint64_t count = 1;
+    uint64_t depth = LI->getLoopDepth(parent);
+    for (uint64_t i = 0; loop && i < depth; ++i) {
+        uint64_t tripCount = 0;
+        if (SE->hasLoopInvariantBackedgeTakenCount(loop)) {
+            const SCEV *takenCount = SE->getBackedgeTakenCount(loop);
+            if (isa<SCEVConstant>(takenCount)) {
+                tripCount = cast<SCEVConstant>(takenCount)->getAPInt()
+                                            .getLimitedValue(UINT64_MAX - 1);
+            }
+        }
+
+        if (!tripCount) {
+            // Only have loop depth.
+            return depth * count;
+        }
+
+        count *= tripCount;
+        loop = loop->getParentLoop();
+    }
+
+    return count;
+}
+
+// PUBLIC MANIPULATORS
+void CostModel::reset(const targetDescription& target)
+{
+    m_costs = {
+        {"default",      target.costDefault},
+        {"udiv",         target.costDivNPow2},
+        {"sdiv",         target.costDivNPow2},
+        {"fdiv",         target.costDivNPow2},
+        {"udiv.pow2",    target.costDivPow2},
+        {"sdiv.pow2",    target.costDivPow2},
+        {"urem",         target.costModNPow2},
+        {"srem",         target.costModNPow2},
+        {"frem",         target.costModNPow2},
+        {"urem.pow2",    target.costModPow2},
+        {"srem.pow2",    target.costModPow2},
+        {"br",           target.costBranchDiv},
+        {"load",         target.costLoadGlobal},
+        {"store",        target.costStoreGlobal},
+        {"load.shared",  target.costLoadShared},
+        {"store.shared", target.costStoreShared},
+        {"math.float",   target.costMathFuncF},
+        {"math.double",  target.costMathFuncD}
+    };
+}
+
+bool CostModel::load(const std::string& path, std::string& error)
+{
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    std::string line;
+    unsigned int lineNumber = 0;
+    while (std::getline(file, line)) {
+        ++lineNumber;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream ts(line);
+        std::string key;
+        double cost = 0;
+        if (!(ts >> key)) {
+            // Empty line.
+            continue;
+        }
+
+        std::string rest;
+        if (!(ts >> cost) || cost < 0 || (ts >> rest)) {
+            error = path + ":" + std::to_string(lineNumber) +
+                    ": expected '<key> <cost>'";
+            return false;
+        }
+        m_costs[key] = cost;
+    }
+    return true;
+}
+
+// PRIVATE ACCESSORS
+std::vector<std::string> CostModel::candidateKeys(Instruction *inst) const
+{
+    std::vector<std::string> keys;
+    std::string op = inst->getOpcodeName();
+    std::string qualifier;
+    std::string type = costTypeName(inst->getType());
+
+    if (CallInst *call = dyn_cast<CallInst>(inst)) {
+        Function *callee = call->getCalledFunction();
+        if (callee) {
+            keys.push_back(op + "." + callee->getName().str());
+            if (isMathFunction(callee->getName())) {
+                if (!type.empty()) {
+                    keys.push_back("math." + type);
+                }
+                keys.push_back("math");
+            }
+        }
+        keys.push_back(op);
+        keys.push_back("default");
+        return keys;
+    }
+
+    if (Value *pointer = getLoadStorePointerOperand(inst)) {
+        const DataLayout& DL = inst->getModule()->getDataLayout();
+        qualifier = costAddressSpace(pointer, DL);
+        if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+            type = costTypeName(store->getValueOperand()->getType());
+        }
+    }
+    else if (inst->getOpcode() == Instruction::UDiv ||
+             inst->getOpcode() == Instruction::SDiv ||
+             inst->getOpcode() == Instruction::URem ||
+             inst->getOpcode() == Instruction::SRem) {
+        ConstantInt *divisor = dyn_cast<ConstantInt>(inst->getOperand(1));
+        if (divisor && divisor->getValue().isPowerOf2()) {
+            qualifier = "pow2";
+        }
+    }
+
+    if (!qualifier.empty() && !type.empty()) {
+        keys.push_back(op + "." + qualifier + "." + type);
+    }
+    if (!qualifier.empty()) {
+        keys.push_back(op + "." + qualifier);
+    }
+    if (!type.empty()) {
+        keys.push_back(op + "." + type);
+    }
+    keys.push_back(op);
+    keys.push_back("default");
+    return keys;
+}
+
+void CUDACoarseningPass::writeCostFeatures(Function& F, unsigned int work)
+{
+    // Executions of the instructions of F by their most specific key, per
+    // original thread ('work' threads are merged into one). Together with
+    // the measured run times of the versions, they let rpc-calibrate fit
+    // the costs of the keys, including the ones the current model lacks.
+    if (CLCoarseningCostFeatures.empty()) {
+        return;
+    }
+
+    // The keys and the elements do not depend on the costs.
+    CostModel model;
+
+    LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+    ScalarEvolution *SE =
+                    &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+    BankConflictAnalysisPass *bankConflicts =
+                    &getAnalysis<BankConflictAnalysisPass>(F);
+
+    std::map<Instruction *, double> conflicts;
+    for (const sharedAccess& access : bankConflicts->getSharedAccesses()) {
+        conflicts[access.inst] = bankConflicts->conflictDegree(access, 1, 1);
+    }
+
+    std::map<std::string, double> features;
+    for (BasicBlock& B : F) {
+        for (Instruction& I : B) {
+            double executions = CostModel::executionCount(&I, LI, SE) *
+                                model.getElements(&I);
+            if (conflicts.count(&I)) {
+                executions *= conflicts[&I];
+            }
+            features[model.getFeatureKey(&I)] += executions / work;
+        }
+    }
+
+    std::error_code EC;
+    raw_fd_ostream os(CLCoarseningCostFeatures, EC, sys::fs::OF_Append);
+    if (EC) {
+        errs() << "--  WARN  -- Cannot write cost features to "
+               << CLCoarseningCostFeatures << ": " << EC.message() << "\n";
+        return;
+    }
+
+    // Versions are named the way the runtime finds them.
+    std::string name = Util::nameFromDemangled(Util::demangle(F.getName()));
+    for (auto& feature : features) {
+        os << name << "," << feature.first << "," << feature.second << "\n";
+    }
+}
@@ -0,0 +1,70 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Instruction cost model of the benefit analysis
+// ============================================================================
+
+#ifndef LLVM_LIB_TRANSFORMS_CUDA_COARSENING_COSTMODEL_H
+#define LLVM_LIB_TRANSFORMS_CUDA_COARSENING_COSTMODEL_H
+
+namespace llvm {
+    class Instruction;
+    class LoopInfo;
+    class ScalarEvolution;
+}
+
+struct targetDescription;
+
+// Costs are looked up by keys, from the most specific one to the least:
+//   <op>.<qualifier>.<type>, <op>.<qualifier>, <op>.<type>, <op>, default
+// where <op> is the opcode name (e.g. load, fdiv) or call.<callee>, the
+// qualifier is the address space of memory accesses (global, shared, local,
+// constant, generic) or pow2 for divisions by powers of two, and <type> is
+// the scalar type (e.g. float, i64). Calls of math functions fall back to
+// math.<type> before default. Vector instructions cost their elements.
+//
+// The file format is one '<key> <cost>' pair per line, '#' starts a comment.
+
+class CostModel {
+  public:
+    // CREATORS
+    CostModel();
+
+    // ACCESSORS
+    double getCost(llvm::Instruction *inst) const;
+        // Cost of one execution of the 'inst'.
+
+    std::string getKey(llvm::Instruction *inst) const;
+        // The key 'inst' takes its cost from.
+
+    std::string getFeatureKey(llvm::Instruction *inst) const;
+        // The most specific key of the 'inst', whatever the loaded costs.
+
+    unsigned int getElements(llvm::Instruction *inst) const;
+        // Number of elements the 'inst' operates on, one for scalars.
+
+    static uint64_t executionCount(llvm::Instruction     *inst,
+                                   llvm::LoopInfo        *LI,
+                                   llvm::ScalarEvolution *SE);
+        // Estimated executions of the 'inst' by a thread: the product of the
+        // trip counts of the enclosing loops when known statically, the loop
+        // depth otherwise.
+
+    // MANIPULATORS
+    void reset(const targetDescription& target);
+        // Replaces all the costs by the defaults of the 'target'.
+
+    bool load(const std::string& path, std::string& error);
+        // Overrides the costs by the ones of the file at 'path'. Returns
+        // false and sets 'error' if the file cannot be read or parsed.
+
+  private:
+    // PRIVATE ACCESSORS
+    std::vector<std::string> candidateKeys(llvm::Instruction *inst) const;
+
+    // PRIVATE DATA
+    std::map<std::string, double> m_costs;
+};
+
+#endif // LLVM_LIB_TRANSFORMS_CUDA_COARSENING_COSTMODEL_H
@@ -75,6 +75,374 @@ bool DivergenceAnalysisPass::isDivergent(Instruction *inst)
     return isPresent(inst, m_divergent);
 }
 
+// PUBLIC MANIPULATORS
+namespace {
+
+// Value of an instruction in all the replicas of a coarsened thread,
+// relative to the value in the first replica:
+//   v_k = v_0 + k * delta, where v_0 = residue (mod 2^alignBits)
+struct AffineValue {
+    bool     affine;
+    int64_t  delta;
+    unsigned alignBits;
+    uint64_t residue;
+};
+
+const unsigned int AFFINE_MAX_BITS = 32;
+
+AffineValue affineTop()
+{
+    return AffineValue{false, 0, 0, 0};
+}
+
+AffineValue affineValue(int64_t delta, unsigned int bits, uint64_t residue)
+{
+    bits = std::min(bits, AFFINE_MAX_BITS);
+    uint64_t mask = (bits == 0) ? 0 : (~0ULL >> (64 - bits));
+    return AffineValue{true, delta, bits, residue & mask};
+}
+
+bool isUniform(const AffineValue& value)
+{
+    return value.affine && value.delta == 0;
+}
+
+bool operator!=(const AffineValue& lhs, const AffineValue& rhs)
+{
+    return lhs.affine != rhs.affine || lhs.delta != rhs.delta ||
+           lhs.alignBits != rhs.alignBits || lhs.residue != rhs.residue;
+}
+
+// v / 2^bits, floor semantics.
+AffineValue affineShiftRight(const AffineValue& value,
+                             unsigned int       bits,
+                             unsigned int       factor)
+{
+    int64_t divisor = 1LL << bits;
+    unsigned int alignBits = value.alignBits > bits ? value.alignBits - bits
+                                                    : 0;
+    uint64_t residue = value.residue >> bits;
+
+    if (value.delta == 0) {
+        return affineValue(0, alignBits, residue);
+    }
+
+    // All the replicas fall into the same 2^bits window: they stay in the
+    // aligned 2^a window of the first one, which nests in it.
+    unsigned int windowBits = std::min(value.alignBits, bits);
+    int64_t window = 1LL << windowBits;
+    if (value.delta > 0 &&
+        (int64_t) (value.residue & (window - 1)) +
+        value.delta * (factor - 1) < window) {
+        return affineValue(0, alignBits, residue);
+    }
+
+    if (value.delta % divisor == 0) {
+        return affineValue(value.delta / divisor, alignBits, residue);
+    }
+
+    return affineTop();
+}
+
+// v mod 2^bits.
+AffineValue affineLowBits(const AffineValue& value, unsigned int bits)
+{
+    int64_t divisor = 1LL << bits;
+    if (value.delta % divisor == 0) {
+        return affineValue(0, std::min(value.alignBits, bits), value.residue);
+    }
+    return affineTop();
+}
+
+// v & ~(2^bits - 1).
+AffineValue affineHighBits(const AffineValue& value,
+                           unsigned int       bits,
+                           unsigned int       factor)
+{
+    int64_t divisor = 1LL << bits;
+    uint64_t residue = value.alignBits >= bits
+                       ? value.residue & ~((uint64_t) divisor - 1)
+                       : 0;
+    unsigned int alignBits = std::max(value.alignBits, bits);
+
+    if (isUniform(affineShiftRight(value, bits, factor))) {
+        return affineValue(0, alignBits, residue);
+    }
+    if (value.delta % divisor == 0) {
+        return affineValue(value.delta, alignBits, residue);
+    }
+    return affineTop();
+}
+
+AffineValue affineTransfer(Instruction                           *inst,
+                           std::function<AffineValue(Value *)>    operand,
+                           bool                                   blockLevel,
+                           unsigned int                           factor)
+{
+    if (BinaryOperator *binOp = dyn_cast<BinaryOperator>(inst)) {
+        AffineValue lhs = operand(binOp->getOperand(0));
+        AffineValue rhs = operand(binOp->getOperand(1));
+        if (!lhs.affine || !rhs.affine) {
+            return affineTop();
+        }
+
+        ConstantInt *constant = dyn_cast<ConstantInt>(binOp->getOperand(1));
+        uint64_t cval = constant ? constant->getZExtValue() : 0;
+        bool isPow2 = constant && constant->getValue().isPowerOf2();
+        unsigned int log2 = isPow2 ? constant->getValue().logBase2() : 0;
+
+        switch (binOp->getOpcode()) {
+        case Instruction::Add:
+            return affineValue(lhs.delta + rhs.delta,
+                               std::min(lhs.alignBits, rhs.alignBits),
+                               lhs.residue + rhs.residue);
+        case Instruction::Sub:
+            return affineValue(lhs.delta - rhs.delta,
+                               std::min(lhs.alignBits, rhs.alignBits),
+                               lhs.residue - rhs.residue);
+        case Instruction::Mul:
+        case Instruction::Shl: {
+            if (!constant) {
+                if (isUniform(lhs) && isUniform(rhs)) {
+                    return affineValue(0, 0, 0);
+                }
+                return affineTop();
+            }
+            if (binOp->getOpcode() == Instruction::Shl && cval >= 32) {
+                return affineTop();
+            }
+            int64_t multiplier = (binOp->getOpcode() == Instruction::Mul)
+                                 ? constant->getSExtValue()
+                                 : (1LL << cval);
+            if (multiplier == 0) {
+                return affineValue(0, AFFINE_MAX_BITS, 0);
+            }
+            unsigned int zeros = countTrailingZeros((uint64_t) multiplier);
+            return affineValue(lhs.delta * multiplier,
+                               lhs.alignBits + zeros,
+                               lhs.residue * multiplier);
+        }
+        case Instruction::LShr:
+        case Instruction::AShr:
+            if (constant && cval < 32) {
+                return affineShiftRight(lhs, cval, factor);
+            }
+            break;
+        case Instruction::UDiv:
+            if (isPow2) {
+                return affineShiftRight(lhs, log2, factor);
+            }
+            break;
+        case Instruction::URem:
+            if (isPow2) {
+                return affineLowBits(lhs, log2);
+            }
+            break;
+        case Instruction::And:
+            if (constant && (constant->getValue() + 1).isPowerOf2()) {
+                return affineLowBits(lhs,
+                                     (constant->getValue() + 1).logBase2());
+            }
+            if (constant && (-constant->getValue()).isPowerOf2()) {
+                return affineHighBits(lhs,
+                                      (-constant->getValue()).logBase2(),
+                                      factor);
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (isUniform(lhs) && isUniform(rhs)) {
+            return affineValue(0, 0, 0);
+        }
+        return affineTop();
+    }
+
+    if (CastInst *cast = dyn_cast<CastInst>(inst)) {
+        AffineValue value = operand(cast->getOperand(0));
+        if (!value.affine || !cast->isIntegerCast()) {
+            return isUniform(value) ? affineValue(0, 0, 0) : affineTop();
+        }
+        unsigned int width = cast->getType()->getScalarSizeInBits();
+        return affineValue(value.delta,
+                           std::min(value.alignBits, width),
+                           value.residue);
+    }
+
+    // Control-dependent values and anything with side effects, other
+    // than an idempotent store, has to be executed by every replica.
+    if (isa<PHINode>(inst) || isa<AtomicRMWInst>(inst) ||
+        isa<AtomicCmpXchgInst>(inst)) {
+        return affineTop();
+    }
+    if (inst->mayWriteToMemory() && !isa<StoreInst>(inst)) {
+        return affineTop();
+    }
+    if (isa<CallInst>(inst) && inst->mayReadFromMemory()) {
+        return affineTop();
+    }
+    if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        // Shared memory is replicated per block.
+        if (blockLevel || !load->isSimple()) {
+            return affineTop();
+        }
+    }
+    if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+        if (blockLevel || !store->isSimple()) {
+            return affineTop();
+        }
+    }
+
+    for (Value *op : inst->operands()) {
+        if (!isUniform(operand(op))) {
+            return affineTop();
+        }
+    }
+    return affineValue(0, 0, 0);
+}
+
+} // anonymous namespace
+
+void DivergenceAnalysisPass::refineAffine(unsigned int factor,
+                                          unsigned int stride)
+{
+    if (m_divergent.empty() || factor < 2) {
+        return;
+    }
+
+    Function *F = m_divergent.front()->getParent()->getParent();
+    InstSet divergent(m_divergent.begin(), m_divergent.end());
+
+    InstVector seeds =
+        m_blockLevel
+        ? m_grid->getBlockIDDependentInstructions(m_dimension)
+        : m_grid->getThreadIDDependentInstructions(m_dimension);
+
+    // First replica reads base = (id / st) * cf * st + id % st,
+    // replica k reads base + k * st.
+    unsigned int seedBits = (stride == 1 && isPowerOf2_32(factor))
+                            ? Log2_32(factor)
+                            : 0;
+
+    std::map<Instruction *, AffineValue> values;
+    for (Instruction *inst : m_divergent) {
+        values[inst] = affineTop();
+    }
+    for (Instruction *seed : seeds) {
+        values[seed] = affineValue(stride, seedBits, 0);
+    }
+
+    auto operand = [&](Value *value) -> AffineValue {
+        Instruction *inst = dyn_cast<Instruction>(value);
+        if (inst && divergent.count(inst)) {
+            return values[inst];
+        }
+        if (ConstantInt *constant = dyn_cast<ConstantInt>(value)) {
+            if (constant->getBitWidth() <= 64) {
+                return affineValue(0,
+                                   AFFINE_MAX_BITS,
+                                   constant->getZExtValue());
+            }
+        }
+        return affineValue(0, 0, 0);
+    };
+
+    // Iterate in program order until nothing changes. Everything starts
+    // as divergent and PHIs stay divergent, so this terminates quickly.
+    bool changed = true;
+    for (unsigned int round = 0; changed && round < 8; ++round) {
+        changed = false;
+        for (BasicBlock& B : *F) {
+            for (Instruction& I : B) {
+                Instruction *inst = &I;
+                if (!divergent.count(inst) || isPresent(inst, seeds)) {
+                    continue;
+                }
+
+                // Instructions made divergent through shared memory or
+                // control dependence have no divergent operand.
+                bool dataDependent = false;
+                for (Value *op : inst->operands()) {
+                    Instruction *opInst = dyn_cast<Instruction>(op);
+                    if (opInst && divergent.count(opInst)) {
+                        dataDependent = true;
+                    }
+                }
+                if (!dataDependent) {
+                    continue;
+                }
+
+                AffineValue value = affineTransfer(inst,
+                                                   operand,
+                                                   m_blockLevel,
+                                                   factor);
+                if (value != values[inst]) {
+                    values[inst] = value;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    InstVector refined;
+    unsigned int uniform = 0;
+    for (Instruction *inst : m_divergent) {
+        if (!isPresent(inst, seeds) && isUniform(values[inst])) {
+            ++uniform;
+            continue;
+        }
+        refined.push_back(inst);
+    }
+
+    if (uniform == 0) {
+        return;
+    }
+
+    errs() << "--  INFO  -- " << uniform << " instructions are uniform "
+           << "across replicas\n";
+
+    // Branches and regions depend on the divergent set.
+    m_divergent.swap(refined);
+    m_outermostDivergent.clear();
+    m_divergentBranches.clear();
+    m_regions.clear();
+    m_outermostRegions.clear();
+
+    findDivergentBranches();
+    findRegions();
+}
+
+void DivergenceAnalysisPass::removeRegion(DivergentRegion *region)
+{
+    m_regions.erase(std::remove(m_regions.begin(), m_regions.end(), region),
+                    m_regions.end());
+
+    // Memoized results depend on the regions.
+    m_outermostRegions.clear();
+    m_outermostDivergent.clear();
+}
+
+void DivergenceAnalysisPass::replaceInstruction(Instruction *oldInst,
+                                                Instruction *newInst)
+{
+    for (InstVector *insts : {&m_divergent, &m_divergentBranches}) {
+        auto iter = std::find(insts->begin(), insts->end(), oldInst);
+        if (iter == insts->end()) {
+            continue;
+        }
+
+        if (newInst) {
+            *iter = newInst;
+        }
+        else {
+            insts->erase(iter);
+        }
+    }
+
+    m_outermostDivergent.clear();
+}
+
 // PRIVATE MANIPULATORS
 void DivergenceAnalysisPass::clear()
 {
@@ -34,6 +34,23 @@ public:
 
     bool isDivergent(Instruction *inst);
 
+    // MANIPULATORS
+    void refineAffine(unsigned int factor, unsigned int stride);
+      // Drops from the divergent set the instructions whose value is the
+      // same in all the replicas of a coarsened thread (block), given the
+      // coarsening 'factor' and 'stride'. Values are tracked as affine
+      // functions of the thread (block) index, e.g. 'tid / 32' is uniform
+      // for stride 1 and factors dividing 32, 'tid & 31' is uniform for
+      // strides that are multiples of 32.
+
+    void removeRegion(DivergentRegion *region);
+      // Removes the 'region' from the divergent regions, used once the
+      // region was flattened into straight-line code.
+
+    void replaceInstruction(Instruction *oldInst, Instruction *newInst);
+      // Replaces divergent 'oldInst' with 'newInst' (or removes it, if
+      // 'newInst' is null) before 'oldInst' is erased from the IR.
+
 protected:
     // PRIVATE MANIPULATORS
     void clear();
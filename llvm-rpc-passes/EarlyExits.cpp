@@ -0,0 +1,121 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Normalization of early exits into per-replica active masks
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/PostDominators.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+#include "RegionBounds.h"
+#include "DivergentRegion.h"
+#include "DivergenceAnalysisPass.h"
+
+extern cl::opt<bool> CLCoarseningEarlyExits;
+extern cl::opt<bool> CLCoarseningGuarded;
+
+bool isReturnBlock(BasicBlock *block)
+{
+    // Only forwards the control to a 'ret void', possibly through more such
+    // blocks, and all its phi nodes are dead.
+    std::set<BasicBlock *> visited;
+    while (block && visited.insert(block).second) {
+        for (Instruction& I : *block) {
+            if (&I != block->getTerminator() &&
+                !(isa<PHINode>(I) && I.use_empty())) {
+                return false;
+            }
+        }
+
+        if (ReturnInst *ret = dyn_cast<ReturnInst>(block->getTerminator())) {
+            return ret->getReturnValue() == nullptr;
+        }
+        block = block->getSingleSuccessor();
+    }
+    return false;
+}
+
+void CUDACoarseningPass::normalizeEarlyExits(Function& F)
+{
+    // Boundary checks such as 'if (idx >= n) return;' make the rest of the
+    // kernel a single divergent region, replicated as a whole together with
+    // its barriers. Instead, the branch is dropped, the rest of the kernel
+    // is coarsened as usual, and each replica keeps an active mask guarding
+    // its instructions below the exit, see 'guardReplicas'.
+    m_earlyExits.clear();
+    if (!CLCoarseningEarlyExits) {
+        return;
+    }
+
+    DivergenceAnalysisPass *divergence = m_divergenceAnalysisTL;
+    if (m_blockLevel) {
+        divergence = m_divergenceAnalysisBL;
+    }
+
+    // Exits further down only post-dominate the entry once the exits above
+    // them are gone.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        RegionVector regions = divergence->getRegions();
+        for (DivergentRegion *region : regions) {
+            // Exits all the threads (blocks) pass through, outside loops.
+            BasicBlock *header = region->getHeader();
+            BranchInst *branch = dyn_cast<BranchInst>(header->getTerminator());
+            if (!branch || !branch->isConditional() ||
+                m_loopInfo->getLoopFor(header) ||
+                !m_postDomT->dominates(header, &F.getEntryBlock())) {
+                continue;
+            }
+
+            bool onTrue = isReturnBlock(branch->getSuccessor(0));
+            if (onTrue == isReturnBlock(branch->getSuccessor(1))) {
+                continue;
+            }
+
+            BasicBlock *exit = branch->getSuccessor(onTrue ? 0 : 1);
+            BasicBlock *body = branch->getSuccessor(onTrue ? 1 : 0);
+
+            EarlyExit earlyExit = { header, branch->getCondition(), onTrue };
+            m_earlyExits.push_back(earlyExit);
+
+            exit->removePredecessor(header);
+            divergence->replaceInstruction(branch, nullptr);
+            BranchInst::Create(body, branch);
+            branch->eraseFromParent();
+
+            divergence->removeRegion(region);
+            delete region;
+
+            errs() << "--  INFO  -- Normalized early exit in "
+                   << header->getName() << " into per-replica active masks\n";
+
+            m_domT->recalculate(F);
+            m_postDomT->recalculate(F);
+            changed = true;
+            break;
+        }
+    }
+
+    // The exits are on a single path from the entry, the masks accumulate
+    // in their dominance order.
+    std::sort(m_earlyExits.begin(),
+              m_earlyExits.end(),
+              [this](const EarlyExit& first, const EarlyExit& second) {
+                  return first.block != second.block &&
+                         m_domT->dominates(first.block, second.block);
+              });
+}
+
+bool CUDACoarseningPass::hasReplicaGuards() const
+{
+    return CLCoarseningGuarded || !m_earlyExits.empty();
+}
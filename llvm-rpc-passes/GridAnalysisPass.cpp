@@ -9,6 +9,10 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+
 #include "Common.h"
 #include "Util.h"
 #include "GridAnalysisPass.h"
@@ -158,9 +162,34 @@ InstVector GridAnalysisPass::getShuffleInstructions() const
     return shuffleInstructions;
 }
 
+LoopVector GridAnalysisPass::getGridStrideLoops(unsigned int dimension) const
+{
+    return gridStrideLoops[dimension];
+}
+
+bool GridAnalysisPass::isGridStrideKernel(unsigned int dimension) const
+{
+    if (gridStrideLoops[dimension].empty()) {
+        return false;
+    }
+
+    const varInstructions_t& varInstructions = gridInstructions[dimension];
+    for (auto& var : varInstructions) {
+        for (Instruction *builtin : var.second) {
+            if (!isGridStrideUse(builtin, dimension)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 // PUBLIC MANIPULATORS
 void GridAnalysisPass::getAnalysisUsage(AnalysisUsage& AU) const
 {
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
     AU.setPreservesAll();
 }
 
@@ -169,6 +198,9 @@ bool GridAnalysisPass::runOnFunction(Function& F)
     //errs() << "--  INFO  -- Grid analysis invoked on: ";
     //errs().write_escaped(F.getName()) << '\n';
 
+    loopInfo = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    scalarEvolution = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
     init();
     analyse(&F);
 
@@ -181,6 +213,8 @@ void GridAnalysisPass::init()
     // Clear data, as pass can run multiple times
     gridInstructions.clear();
     gridInstructions.reserve(CUDA_MAX_DIM);
+    gridStrideLoops.clear();
+    gridStrideLoops.resize(CUDA_MAX_DIM);
     shuffleInstructions.clear();
 
     for (unsigned int i = 0; i < CUDA_MAX_DIM; ++i) {
@@ -209,6 +243,10 @@ void GridAnalysisPass::analyse(Function *pF)
     findInstructionsByName(base + CUDA_SHUFFLE_IDX + ".f32", pF, &shuffleInstructions);
     findInstructionsByName(base + CUDA_SHUFFLE_BFLY + ".i32", pF, &shuffleInstructions);
     findInstructionsByName(base + CUDA_SHUFFLE_BFLY + ".f32", pF, &shuffleInstructions);
+
+    for (unsigned int i = 0; i < CUDA_MAX_DIM; ++i) {
+        findGridStrideLoops(i);
+    }
 }
 
 void GridAnalysisPass::findInstructionsByVar(std::string var, Function *pF)
@@ -259,6 +297,149 @@ void GridAnalysisPass::findInstructionsByName(std::string  name,
     }
 }
 
+void GridAnalysisPass::findGridStrideLoops(unsigned int dimension)
+{
+    for (Loop *loop : loopInfo->getLoopsInPreorder()) {
+        if (gridStrideInductionVariable(loop, dimension)) {
+            gridStrideLoops[dimension].push_back(loop);
+        }
+    }
+}
+
+// PRIVATE ACCESSORS
+PHINode *GridAnalysisPass::gridStrideInductionVariable(
+                                                 Loop         *loop,
+                                                 unsigned int  dimension) const
+{
+    // Grid-stride induction variable is an affine recurrence
+    // {blockIdx * blockDim + threadIdx, +, blockDim * gridDim}.
+    InstVector tids = getThreadIDDependentInstructions(dimension);
+    InstVector bids = getBlockIDDependentInstructions(dimension);
+    InstVector bdims = getBlockSizeDependentInstructions(dimension);
+    InstVector gdims = getGridSizeDependentInstructions(dimension);
+
+    for (PHINode& phi : loop->getHeader()->phis()) {
+        if (!scalarEvolution->isSCEVable(phi.getType())) {
+            continue;
+        }
+
+        const SCEVAddRecExpr *rec =
+                    dyn_cast<SCEVAddRecExpr>(scalarEvolution->getSCEV(&phi));
+        if (!rec || rec->getLoop() != loop || !rec->isAffine()) {
+            continue;
+        }
+
+        const SCEV *start = rec->getStart();
+        if (!usesBuiltin(start, tids) || !usesBuiltin(start, bids)) {
+            continue;
+        }
+
+        // Look through the extensions, the step is often computed
+        // in 32 bits and widened afterwards.
+        const SCEV *step = rec->getStepRecurrence(*scalarEvolution);
+        while (const SCEVCastExpr *cast = dyn_cast<SCEVCastExpr>(step)) {
+            step = cast->getOperand();
+        }
+
+        const SCEVMulExpr *mul = dyn_cast<SCEVMulExpr>(step);
+        if (!mul || mul->getNumOperands() != 2) {
+            continue;
+        }
+
+        if (usesBuiltin(mul, bdims) && usesBuiltin(mul, gdims) &&
+            !usesBuiltin(mul, tids) && !usesBuiltin(mul, bids)) {
+            return &phi;
+        }
+    }
+
+    return nullptr;
+}
+
+bool GridAnalysisPass::isGridStrideUse(Instruction  *builtin,
+                                       unsigned int  dimension) const
+{
+    // Follow the arithmetic computed from the built-in. It has to end up
+    // in the induction variable of a grid-stride loop, or in a comparison
+    // guarding entry to (or continuation of) such a loop.
+    InstVector worklist = { builtin };
+    InstSet visited;
+
+    while (!worklist.empty()) {
+        Instruction *inst = worklist.back();
+        worklist.pop_back();
+
+        for (User *user : inst->users()) {
+            Instruction *userInst = dyn_cast<Instruction>(user);
+            if (!userInst) {
+                return false;
+            }
+
+            if (!visited.insert(userInst).second) {
+                continue;
+            }
+
+            if (PHINode *phi = dyn_cast<PHINode>(userInst)) {
+                bool isInduction = false;
+                for (Loop *loop : gridStrideLoops[dimension]) {
+                    if (gridStrideInductionVariable(loop, dimension) == phi) {
+                        isInduction = true;
+                    }
+                }
+
+                if (!isInduction) {
+                    return false;
+                }
+                continue;
+            }
+
+            if (isa<ICmpInst>(userInst)) {
+                for (User *cmpUser : userInst->users()) {
+                    BranchInst *branch = dyn_cast<BranchInst>(cmpUser);
+                    if (!branch) {
+                        return false;
+                    }
+
+                    bool guardsLoop = false;
+                    for (Loop *loop : gridStrideLoops[dimension]) {
+                        for (BasicBlock *succ : branch->successors()) {
+                            if (succ == loop->getHeader() ||
+                                succ == loop->getLoopPreheader()) {
+                                guardsLoop = true;
+                            }
+                        }
+                    }
+
+                    if (!guardsLoop) {
+                        return false;
+                    }
+                }
+                continue;
+            }
+
+            if (isa<BinaryOperator>(userInst) || isa<CastInst>(userInst)) {
+                worklist.push_back(userInst);
+                continue;
+            }
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool GridAnalysisPass::usesBuiltin(const SCEV       *scev,
+                                   const InstVector& builtins) const
+{
+    return SCEVExprContains(scev, [&builtins](const SCEV *S) {
+        if (const SCEVUnknown *unknown = dyn_cast<SCEVUnknown>(S)) {
+            Instruction *inst = dyn_cast<Instruction>(unknown->getValue());
+            return inst && isPresent(inst, builtins);
+        }
+        return false;
+    });
+}
+
 static RegisterPass<GridAnalysisPass> X("cuda-grid-analysis-pass",
                                         "CUDA Grid Analysis Pass",
                                         false, // Only looks at CFG
@@ -10,6 +10,11 @@
 using namespace llvm;
 
 namespace llvm {
+    class Loop;
+    class LoopInfo;
+    class ScalarEvolution;
+    class SCEV;
+    class PHINode;
 }
 
 class GridAnalysisPass : public FunctionPass {
@@ -30,6 +35,18 @@ public:
 
     InstVector getShuffleInstructions() const;
 
+    LoopVector getGridStrideLoops(unsigned int dimension) const;
+      // Returns loops of the form
+      //   for (i = blockIdx * blockDim + threadIdx; ...; i += blockDim * gridDim)
+      // in the given dimension, as recognized by ScalarEvolution.
+
+    bool isGridStrideKernel(unsigned int dimension) const;
+      // Returns true if and only if all the grid built-ins of the given
+      // dimension are consumed by the initial value, the step or the entry
+      // guard of grid-stride loops. Such kernels stay correct for any launch
+      // configuration, so they can be coarsened by launching fewer threads
+      // without replicating any code.
+
     // MANIPULATORS
     void getAnalysisUsage(AnalysisUsage& AU) const override;
     bool runOnFunction(Function& F) override;
@@ -52,10 +69,22 @@ private:
     void findInstructionsByName(std::string  name,
                                 Function    *pF,
                                 InstVector  *out);
+    void findGridStrideLoops(unsigned int dimension);
+
+    // PRIVATE ACCESSORS
+    PHINode *gridStrideInductionVariable(Loop         *loop,
+                                         unsigned int  dimension) const;
+    bool isGridStrideUse(Instruction *user, unsigned int dimension) const;
+    bool usesBuiltin(const SCEV       *scev,
+                     const InstVector& builtins) const;
 
     // DATA
     std::vector<varInstructions_t> gridInstructions;
+    std::vector<LoopVector> gridStrideLoops;
     InstVector shuffleInstructions;
+
+    LoopInfo        *loopInfo;
+    ScalarEvolution *scalarEvolution;
 };
 
 #endif
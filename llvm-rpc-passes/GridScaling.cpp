@@ -8,13 +8,27 @@
 
 #include <llvm/Pass.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
 #include "Common.h"
 #include "CUDACoarsening.h"
 #include "Util.h"
+#include "RegionBounds.h"
+#include "DivergentRegion.h"
 #include "DivergenceAnalysisPass.h"
 #include "GridAnalysisPass.h"
 
+extern cl::opt<bool> CLCoarseningGuarded;
+
 // Support functions.
 Instruction *getMulInst(Value *value, unsigned int factor);
 Instruction *getAddInst(Value *value, unsigned int addend);
@@ -23,6 +37,13 @@ Instruction *getShiftInst(Value *value, unsigned int shift);
 Instruction *getAndInst(Value *value, unsigned int factor);
 Instruction *getDivInst(Value *value, unsigned int divisor);
 Instruction *getModuloInst(Value *value, unsigned int modulo);
+Constant *getGuardedValue(Type *type);
+
+// NVVM annotation helpers.
+bool findOneNVVMAnnotation(const GlobalValue  *gv,
+                           const std::string&  prop,
+                           unsigned int&       retval);
+void clearAnnotationCache(const Module *Mod);
 
 void CUDACoarseningPass::scaleKernelGrid()
 {
@@ -40,8 +61,21 @@ void CUDACoarseningPass::scaleKernelGridSizes(unsigned int dimension)
     for (InstVector::iterator iter = sizeInsts.begin();
          iter != sizeInsts.end();
          ++iter) {
-        // Scale size.
         Instruction *inst = *iter;
+        if (CLCoarseningGuarded) {
+            // The grid was rounded up, the original size is passed in.
+            Function *F = inst->getFunction();
+            Instruction *extent = CastInst::CreateIntegerCast(
+                                                    &*std::prev(F->arg_end()),
+                                                    inst->getType(),
+                                                    false,
+                                                    "extent");
+            extent->insertAfter(inst);
+            Util::replaceUses(inst, extent);
+            continue;
+        }
+
+        // Scale size.
         Instruction *mul = getMulInst(inst, m_factor);
         mul->insertAfter(inst);
         // Replace uses of the old size with the scaled one.
@@ -77,6 +111,12 @@ void CUDACoarseningPass::scaleKernelGridIDs(unsigned int dimension)
         Util::replaceUses(inst, base);
         modulo->setOperand(0, inst);
         div->setOperand(0, inst);
+        if (m_swizzle) {
+            // Merge the blocks in the swizzled order.
+            Value *swizzled = swizzleBlockID(inst, div);
+            modulo->setOperand(0, swizzled);
+            div->setOperand(0, swizzled);
+        }
 
         // Compute the remaining thread ids.
         m_coarseningMap.insert(
@@ -95,6 +135,492 @@ void CUDACoarseningPass::scaleKernelGridIDs(unsigned int dimension)
     }
 }
 
+Value *CUDACoarseningPass::swizzleBlockID(Value       *id,
+                                          Instruction *insertBefore)
+{
+    // Diagonal order, bid' = (bid + bid_o) % nbid, with 'o' another
+    // dimension of the grid. The blocks of a row then start on different
+    // columns, which spreads the blocks running at the same time over the
+    // memory partitions instead of camping on one of them.
+    Module& M = *insertBefore->getModule();
+    IRBuilder<> builder(insertBefore);
+
+    unsigned int other = (m_dimension == 0) ? 1 : 0;
+    std::string prefix = std::string("llvm.") + CUDA_READ_SPECIAL_REG + ".";
+    FunctionCallee readOther = M.getOrInsertFunction(
+                                    prefix + CUDA_BLOCK_ID_REG + "." +
+                                    Util::dimensionToString(other),
+                                    builder.getInt32Ty());
+    FunctionCallee readSize = M.getOrInsertFunction(
+                                    prefix + CUDA_GRID_DIM_REG + "." +
+                                    Util::dimensionToString(m_dimension),
+                                    builder.getInt32Ty());
+
+    Value *otherID = builder.CreateIntCast(builder.CreateCall(readOther),
+                                           id->getType(),
+                                           false);
+    Value *size = builder.CreateIntCast(builder.CreateCall(readSize),
+                                        id->getType(),
+                                        false);
+    return builder.CreateURem(builder.CreateAdd(id, otherID),
+                              size,
+                              id->getName() + ".swizzled");
+}
+
+void CUDACoarseningPass::scaleLaunchBounds(Function& F, Function& version)
+{
+    // Launch bounds of the original kernel, as emitted for __launch_bounds__
+    // and __attribute__((reqd_work_group_size)).
+    static const std::vector<std::string> boundProps = {
+        "maxntidx", "maxntidy", "maxntidz",
+        "reqntidx", "reqntidy", "reqntidz",
+        "minctasm"
+    };
+
+    Module& M = *F.getParent();
+    LLVMContext& ctx = M.getContext();
+    std::string dim = Util::dimensionToString(m_dimension);
+
+    std::vector<std::pair<std::string, unsigned int>> bounds;
+    for (const std::string& prop : boundProps) {
+        unsigned int value = 0;
+        if (!findOneNVVMAnnotation(&F, prop, value)) {
+            continue;
+        }
+
+        if (!m_blockLevel && prop == "maxntid" + dim) {
+            // Blocks shrink by the factor (rounded down by the host).
+            value = (value + m_factor - 1) / m_factor;
+        }
+        else if (!m_blockLevel && prop == "reqntid" + dim) {
+            if (value % m_factor != 0) {
+                errs() << "--  WARN  -- Required block size " << value
+                       << " is not divisible by factor " << m_factor
+                       << ", dropping reqntid" << dim << "\n";
+                continue;
+            }
+            value /= m_factor;
+        }
+        else if (m_blockLevel && prop == "minctasm") {
+            // Every block now holds factor-times the shared memory and work.
+            value = std::max(1u, value / m_factor);
+        }
+
+        bounds.push_back(std::make_pair(prop, value));
+    }
+
+    NamedMDNode *nvvmMetadataNode =
+                            M.getOrInsertNamedMetadata("nvvm.annotations");
+
+    // Drop launch bounds already attached to the version (coarsening
+    // in place), keeping all the other annotations.
+    std::vector<MDNode *> kept;
+    for (MDNode *node : nvvmMetadataNode->operands()) {
+        GlobalValue *entity =
+            mdconst::dyn_extract_or_null<GlobalValue>(node->getOperand(0));
+        if (entity != &version) {
+            kept.push_back(node);
+            continue;
+        }
+
+        SmallVector<Metadata *, 8> operandsMD;
+        operandsMD.push_back(node->getOperand(0));
+        for (unsigned int i = 1; i + 1 < node->getNumOperands(); i += 2) {
+            MDString *prop = dyn_cast<MDString>(node->getOperand(i));
+            if (prop && std::find(boundProps.begin(),
+                                  boundProps.end(),
+                                  prop->getString().str()) != boundProps.end()) {
+                continue;
+            }
+            operandsMD.push_back(node->getOperand(i));
+            operandsMD.push_back(node->getOperand(i + 1));
+        }
+
+        if (operandsMD.size() > 1) {
+            kept.push_back(MDTuple::get(ctx, operandsMD));
+        }
+    }
+
+    nvvmMetadataNode->clearOperands();
+    for (MDNode *node : kept) {
+        nvvmMetadataNode->addOperand(node);
+    }
+
+    for (auto& bound : bounds) {
+        SmallVector<Metadata *, 3> operandsMD;
+        operandsMD.push_back(llvm::ValueAsMetadata::getConstant(&version));
+        operandsMD.push_back(llvm::MDString::get(ctx, bound.first));
+        operandsMD.push_back(llvm::ValueAsMetadata::getConstant(
+            llvm::ConstantInt::get(llvm::Type::getInt32Ty(ctx),
+                                   bound.second)));
+
+        nvvmMetadataNode->addOperand(MDTuple::get(ctx, operandsMD));
+    }
+
+    // Cached annotations of this module are stale now.
+    clearAnnotationCache(&M);
+}
+
+Function *CUDACoarseningPass::appendExtentArgument(Function& F)
+{
+    // Guarded kernels take the original extent of the coarsened dimension
+    // as an extra, last argument. The body is moved to a new function with
+    // the extended signature, which replaces 'F'.
+    Module& M = *F.getParent();
+    LLVMContext& ctx = M.getContext();
+
+    FunctionType *type = F.getFunctionType();
+    std::vector<Type *> params(type->param_begin(), type->param_end());
+    params.push_back(Type::getInt32Ty(ctx));
+
+    Function *guarded = Function::Create(
+                    FunctionType::get(type->getReturnType(),
+                                      params,
+                                      type->isVarArg()),
+                    F.getLinkage(),
+                    "",
+                    &M);
+    guarded->copyAttributesFrom(&F);
+    guarded->getBasicBlockList().splice(guarded->begin(),
+                                        F.getBasicBlockList());
+
+    Function::arg_iterator guardedArg = guarded->arg_begin();
+    for (Argument& arg : F.args()) {
+        arg.replaceAllUsesWith(&*guardedArg);
+        guardedArg->takeName(&arg);
+        ++guardedArg;
+    }
+    guardedArg->setName("extent");
+
+    // Move the annotations (kernel, launch bounds) to the new function.
+    NamedMDNode *nvvmMetadataNode = M.getNamedMetadata("nvvm.annotations");
+    if (nvvmMetadataNode) {
+        for (unsigned int i = 0; i < nvvmMetadataNode->getNumOperands(); ++i) {
+            MDNode *node = nvvmMetadataNode->getOperand(i);
+            GlobalValue *entity =
+                mdconst::dyn_extract_or_null<GlobalValue>(node->getOperand(0));
+            if (entity != &F) {
+                continue;
+            }
+
+            SmallVector<Metadata *, 8> operandsMD(node->op_begin(),
+                                                  node->op_end());
+            operandsMD[0] = ValueAsMetadata::getConstant(guarded);
+            nvvmMetadataNode->setOperand(i, MDTuple::get(ctx, operandsMD));
+        }
+        clearAnnotationCache(&M);
+    }
+
+    if (!F.use_empty()) {
+        F.replaceAllUsesWith(ConstantExpr::getBitCast(guarded, F.getType()));
+    }
+    guarded->takeName(&F);
+    F.eraseFromParent();
+
+    return guarded;
+}
+
+void CUDACoarseningPass::guardReplicas(Function& F)
+{
+    // Replica 'k' of a coarsened thread (block) only runs where the original
+    // thread (block) it stands for would. That is within the extent,
+    // 'base + k * stride < extent' (with stride 1, the base itself always
+    // is, as the grid is rounded up to whole multiples of the factor), and
+    // below an early exit only if the replica did not take it.
+    if (!hasReplicaGuards()) {
+        return;
+    }
+
+    std::vector<Value *> valid(m_factor, nullptr);
+    if (CLCoarseningGuarded) {
+        Module& M = *F.getParent();
+        Value *extent = &*std::prev(F.arg_end());
+
+        BasicBlock::iterator point = F.getEntryBlock().begin();
+        while (isa<AllocaInst>(point)) {
+            ++point;
+        }
+        IRBuilder<> builder(&F.getEntryBlock(), point);
+
+        std::string regName = std::string("llvm.") + CUDA_READ_SPECIAL_REG +
+                              "." + (m_blockLevel ? CUDA_BLOCK_ID_REG
+                                                  : CUDA_THREAD_ID_REG) +
+                              "." + Util::dimensionToString(m_dimension);
+        FunctionCallee readReg = M.getOrInsertFunction(regName,
+                                                       builder.getInt32Ty());
+
+        Value *id = builder.CreateCall(readReg);
+        if (m_swizzle) {
+            id = swizzleBlockID(id, &*builder.GetInsertPoint());
+        }
+        Value *base = builder.CreateAdd(
+                builder.CreateMul(builder.CreateUDiv(id, builder.getInt32(
+                                                                  m_stride)),
+                                  builder.getInt32(m_factor * m_stride)),
+                builder.CreateURem(id, builder.getInt32(m_stride)),
+                "base");
+
+        for (unsigned int index = (m_stride == 1) ? 1 : 0;
+             index < m_factor;
+             ++index) {
+            valid[index] = builder.CreateICmpULT(
+                builder.CreateAdd(base, builder.getInt32(index * m_stride)),
+                extent,
+                "valid" + Twine(index));
+        }
+    }
+
+    // Conditions of the replicas below the first 'j' early exits, and of
+    // the uniform instructions there, run if any replica is active.
+    std::vector<std::vector<Value *>> conditions(1, valid);
+    std::vector<Value *> anyActive(1, nullptr);
+    for (EarlyExit& exit : m_earlyExits) {
+        IRBuilder<> builder(exit.block->getTerminator());
+        Instruction *condition = dyn_cast<Instruction>(exit.condition);
+        auto replicas = condition ? m_coarseningMap.find(condition)
+                                  : m_coarseningMap.end();
+
+        std::vector<Value *> level = conditions.back();
+        Value *any = nullptr;
+        for (unsigned int index = 0; index < m_factor; ++index) {
+            Value *replica = exit.condition;
+            if (index > 0 && replicas != m_coarseningMap.end() &&
+                replicas->second.size() >= index) {
+                replica = replicas->second[index - 1];
+            }
+
+            Value *active = exit.onTrue
+                            ? builder.CreateNot(replica, "active")
+                            : replica;
+            level[index] = level[index]
+                           ? builder.CreateAnd(level[index], active)
+                           : active;
+            any = any ? builder.CreateOr(any, level[index]) : level[index];
+        }
+        conditions.push_back(level);
+        anyActive.push_back(any);
+    }
+
+    m_domT->recalculate(F);
+    std::map<BasicBlock *, unsigned int> levels;
+    for (BasicBlock& B : F) {
+        for (unsigned int j = 0; j < m_earlyExits.size(); ++j) {
+            if (&B != m_earlyExits[j].block &&
+                m_domT->dominates(m_earlyExits[j].block, &B)) {
+                levels[&B] = j + 1;
+            }
+        }
+    }
+
+    // Replicated regions are guarded as a whole, their blocks are skipped
+    // below, unless the region has no single entry and exit to guard.
+    std::set<BasicBlock *> skippedBlocks;
+    std::map<BasicBlock *, unsigned int> regionOwners;
+    unsigned int guardedRegions = 0;
+    for (auto& replica : m_replicaRegions) {
+        DivergentRegion *region = replica.first.get();
+        BlockVector& blocks = region->getBlocks();
+        Value *regionValid =
+                conditions[levels[region->getHeader()]][replica.second];
+
+        if (!regionValid || guardRegion(region, regionValid)) {
+            guardedRegions += regionValid ? 1 : 0;
+            skippedBlocks.insert(blocks.begin(), blocks.end());
+        }
+        else {
+            for (BasicBlock *block : blocks) {
+                regionOwners[block] = replica.second;
+            }
+        }
+    }
+    m_replicaRegions.clear();
+
+    // Replicas of single instructions.
+    std::map<Instruction *, unsigned int> owners;
+    for (auto& entry : m_coarseningMap) {
+        owners.insert(std::make_pair(entry.first, 0));
+        for (unsigned int index = 0; index < entry.second.size(); ++index) {
+            owners[entry.second[index]] = index + 1;
+        }
+    }
+
+    // Arithmetic that may trap (divisions) is guarded as well, the exit
+    // protected it from the values of inactive replicas.
+    std::vector<std::pair<Instruction *, Value *>> guardedInsts;
+    std::vector<std::pair<Instruction *, Value *>> guardedDivisions;
+    for (BasicBlock& B : F) {
+        if (skippedBlocks.count(&B)) {
+            continue;
+        }
+
+        unsigned int level = levels.count(&B) ? levels[&B] : 0;
+        auto regionOwner = regionOwners.find(&B);
+        for (Instruction& I : B) {
+            if (isa<PHINode>(I) || I.isTerminator() || isa<AllocaInst>(I) ||
+                (!I.mayReadOrWriteMemory() && !I.mayHaveSideEffects() &&
+                 isSafeToSpeculativelyExecute(&I))) {
+                continue;
+            }
+            if (CallInst *call = dyn_cast<CallInst>(&I)) {
+                if (call->isConvergent()) {
+                    continue;
+                }
+            }
+
+            Value *condition = nullptr;
+            auto instOwner = owners.find(&I);
+            if (regionOwner != regionOwners.end()) {
+                condition = conditions[level][regionOwner->second];
+            }
+            else if (instOwner != owners.end()) {
+                condition = conditions[level][instOwner->second];
+            }
+            else {
+                // Uniform, shared by all the replicas.
+                condition = anyActive[level];
+            }
+
+            if (!condition) {
+                continue;
+            }
+            if (I.getOpcode() == Instruction::UDiv ||
+                I.getOpcode() == Instruction::SDiv ||
+                I.getOpcode() == Instruction::URem ||
+                I.getOpcode() == Instruction::SRem) {
+                guardedDivisions.push_back(std::make_pair(&I, condition));
+            }
+            else {
+                guardedInsts.push_back(std::make_pair(&I, condition));
+            }
+        }
+    }
+
+    // Inactive replicas divide by one, cheaper than a branch around.
+    for (auto& guardedDivision : guardedDivisions) {
+        Instruction *inst = guardedDivision.first;
+        IRBuilder<> builder(inst);
+        inst->setOperand(1, builder.CreateSelect(
+                                guardedDivision.second,
+                                inst->getOperand(1),
+                                getGuardedValue(inst->getType()),
+                                inst->getName() + ".divisor"));
+    }
+
+    m_domT->recalculate(F);
+    for (auto& guardedInst : guardedInsts) {
+        Instruction *inst = guardedInst.first;
+        Instruction *thenTerm = SplitBlockAndInsertIfThen(guardedInst.second,
+                                                          inst,
+                                                          false,
+                                                          nullptr,
+                                                          m_domT,
+                                                          m_loopInfo);
+        BasicBlock *guardBlock = thenTerm->getParent()->getSinglePredecessor();
+        inst->moveBefore(thenTerm);
+
+        if (!inst->use_empty()) {
+            BasicBlock *tail = thenTerm->getSuccessor(0);
+            PHINode *phi = PHINode::Create(inst->getType(),
+                                           2,
+                                           inst->getName() + ".guarded",
+                                           &tail->front());
+            Util::replaceUses(inst, phi);
+            phi->addIncoming(inst, thenTerm->getParent());
+            phi->addIncoming(getGuardedValue(inst->getType()), guardBlock);
+        }
+    }
+
+    errs() << "--  INFO  -- Guarded " << guardedRegions
+           << " replicated regions and "
+           << guardedInsts.size() + guardedDivisions.size()
+           << " instructions of the replicas\n";
+
+    m_domT->recalculate(F);
+    m_postDomT->recalculate(F);
+}
+
+bool CUDACoarseningPass::guardRegion(DivergentRegion *region, Value *valid)
+{
+    BasicBlock *header = region->getHeader();
+    BasicBlock *exiting = region->getExiting();
+    BlockVector& blocks = region->getBlocks();
+
+    // Single entry to the header, single exit from the exiting block.
+    BasicBlock *entry = nullptr;
+    for (BasicBlock *pred : predecessors(header)) {
+        if (isPresent(pred, blocks)) {
+            continue;
+        }
+        if (entry) {
+            return false;
+        }
+        entry = pred;
+    }
+
+    BasicBlock *next = exiting->getSingleSuccessor();
+    if (!entry || !next || isPresent(next, blocks)) {
+        return false;
+    }
+
+    Function *F = header->getParent();
+    LLVMContext& ctx = F->getContext();
+    BasicBlock *guard = BasicBlock::Create(ctx,
+                                           header->getName() + ".guard",
+                                           F,
+                                           header);
+    BasicBlock *join = BasicBlock::Create(ctx,
+                                          exiting->getName() + ".join",
+                                          F,
+                                          next);
+
+    entry->getTerminator()->replaceUsesOfWith(header, guard);
+    BranchInst::Create(header, join, valid, guard);
+    exiting->getTerminator()->replaceUsesOfWith(next, join);
+    BranchInst *joinBranch = BranchInst::Create(next, join);
+
+    Util::remapBlocksInPHIs(header, entry, guard);
+    Util::remapBlocksInPHIs(next, exiting, join);
+
+    if (Loop *loop = m_loopInfo->getLoopFor(entry)) {
+        loop->addBasicBlockToLoop(guard, *m_loopInfo);
+    }
+    if (Loop *loop = m_loopInfo->getLoopFor(next)) {
+        loop->addBasicBlockToLoop(join, *m_loopInfo);
+    }
+
+    // Values of a skipped region take a defined placeholder after it.
+    for (BasicBlock *block : blocks) {
+        for (Instruction& I : *block) {
+            std::vector<Use *> outside;
+            for (Use& use : I.uses()) {
+                Instruction *user = cast<Instruction>(use.getUser());
+                BasicBlock *userBlock = user->getParent();
+                if (PHINode *phi = dyn_cast<PHINode>(user)) {
+                    userBlock = phi->getIncomingBlock(use);
+                }
+                if (!isPresent(userBlock, blocks)) {
+                    outside.push_back(&use);
+                }
+            }
+            if (outside.empty()) {
+                continue;
+            }
+
+            PHINode *phi = PHINode::Create(I.getType(),
+                                           2,
+                                           I.getName() + ".guarded",
+                                           joinBranch);
+            phi->addIncoming(&I, exiting);
+            phi->addIncoming(getGuardedValue(I.getType()), guard);
+            for (Use *use : outside) {
+                use->set(phi);
+            }
+        }
+    }
+
+    return true;
+}
+
 // Support functions.
 //-----------------------------------------------------------------------------
 unsigned int getIntWidth(Value *value) {
@@ -169,4 +695,14 @@ Instruction *getModuloInst(Value *value, unsigned int modulo) {
         BinaryOperator::Create(Instruction::URem, value, intValue);
     moduloInst->setName(Twine(value->getName()) + "..Rem");
     return moduloInst;
-}
\ No newline at end of file
+}
+
+Constant *getGuardedValue(Type *type) {
+    // Value of an instruction in an inactive replica. The arithmetic using
+    // it is not guarded, so it must not be undef: integers take one, which
+    // neither traps as a divisor nor overflows a signed division.
+    if (type->isIntOrIntVectorTy()) {
+        return ConstantInt::get(type, 1);
+    }
+    return Constant::getNullValue(type);
+}
@@ -0,0 +1,117 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Cross-replica redundant load elimination
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+
+extern cl::opt<bool> CLCoarseningLoadReuse;
+
+void CUDACoarseningPass::eliminateRedundantLoads(Function& F)
+{
+    // With stride-1 coarsening, neighbouring replicas often read the same
+    // address (in[i + 1] of replica k is in[i] of replica k + 1). Reuse the
+    // value loaded first instead of issuing the same load again. Guarded
+    // replicas may not issue the load at all.
+    if (!CLCoarseningLoadReuse || hasReplicaGuards()) {
+        return;
+    }
+
+    ScalarEvolution *SE =
+                    &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+
+    // Loads produced by the coarsening: originals and their replicas.
+    InstSet candidates;
+    for (auto& mapIter : m_coarseningMap) {
+        if (isa<LoadInst>(mapIter.first)) {
+            candidates.insert(mapIter.first);
+        }
+        for (Instruction *replica : mapIter.second) {
+            if (isa<LoadInst>(replica)) {
+                candidates.insert(replica);
+            }
+        }
+    }
+
+    std::map<Instruction *, Instruction *> replaced;
+    unsigned int eliminated = 0;
+
+    for (BasicBlock& B : F) {
+        // Loads seen since the last instruction that may write to memory.
+        std::vector<LoadInst *> available;
+
+        for (auto iter = B.begin(); iter != B.end(); ) {
+            Instruction *inst = &*iter++;
+
+            if (inst->mayWriteToMemory()) {
+                available.clear();
+                continue;
+            }
+
+            LoadInst *load = dyn_cast<LoadInst>(inst);
+            if (!load || !load->isSimple() || !candidates.count(load)) {
+                continue;
+            }
+
+            const SCEV *address = SE->getSCEV(load->getPointerOperand());
+
+            LoadInst *reuse = nullptr;
+            for (LoadInst *prev : available) {
+                if (prev->getType() == load->getType() &&
+                    SE->getSCEV(prev->getPointerOperand()) == address) {
+                    reuse = prev;
+                    break;
+                }
+            }
+
+            if (!reuse) {
+                available.push_back(load);
+                continue;
+            }
+
+            load->replaceAllUsesWith(reuse);
+            replaced[load] = reuse;
+            load->eraseFromParent();
+            ++eliminated;
+        }
+    }
+
+    // Keep the coarsening map pointing to live instructions. An entry whose
+    // original was erased is keyed by the load reused for it, unless that
+    // load has an entry of its own. Erased keys must not be dereferenced.
+    CoarseningMap live;
+    std::vector<std::pair<Instruction *, InstVector>> rekeyed;
+    for (auto& mapIter : m_coarseningMap) {
+        for (Instruction *&replica : mapIter.second) {
+            auto iter = replaced.find(replica);
+            if (iter != replaced.end()) {
+                replica = iter->second;
+            }
+        }
+
+        auto iter = replaced.find(mapIter.first);
+        if (iter == replaced.end()) {
+            live.insert(mapIter);
+        }
+        else {
+            rekeyed.push_back({iter->second, mapIter.second});
+        }
+    }
+    for (auto& entry : rekeyed) {
+        live.insert(entry);
+    }
+    m_coarseningMap = live;
+
+    if (eliminated) {
+        errs() << "--  INFO  -- Reused " << eliminated
+               << " replicated loads\n";
+    }
+}
@@ -0,0 +1,317 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Fusion of replicated divergent loops
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+#include "RegionBounds.h"
+#include "DivergentRegion.h"
+
+extern cl::opt<bool> CLCoarseningFuseLoops;
+
+bool CUDACoarseningPass::isFusibleLoop(DivergentRegion *region) const
+{
+    // Replicas of a guarded loop are guarded as separate regions.
+    if (!CLCoarseningFuseLoops || hasReplicaGuards()) {
+        return false;
+    }
+
+    // Single-block loop, whose header is the region header, and whose only
+    // exit block is the region exiting block.
+    BasicBlock *header = region->getHeader();
+    BasicBlock *exiting = region->getExiting();
+    if (!m_loopInfo->isLoopHeader(header)) {
+        return false;
+    }
+
+    Loop *loop = m_loopInfo->getLoopFor(header);
+    if (loop->getNumBlocks() != 1 || !loop->getLoopPreheader() ||
+        loop->getExitBlock() != exiting ||
+        exiting->getSinglePredecessor() != header ||
+        region->getBlocks().size() != 2) {
+        return false;
+    }
+
+    BranchInst *branch = dyn_cast<BranchInst>(header->getTerminator());
+    if (!branch || !branch->isConditional()) {
+        return false;
+    }
+
+    // The exit block only forwards the values computed in the loop.
+    BranchInst *exitBranch = dyn_cast<BranchInst>(exiting->getTerminator());
+    if (exiting->getFirstNonPHI() != exitBranch ||
+        exitBranch->isConditional()) {
+        return false;
+    }
+
+    // Replica bodies execute under per-replica predicates, which is not
+    // legal for convergent operations (barriers, shuffles).
+    for (Instruction& I : *header) {
+        if (CallInst *call = dyn_cast<CallInst>(&I)) {
+            if (call->isConvergent()) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void CUDACoarseningPass::replicateLoopFused(DivergentRegion *region)
+{
+    // The replicas of a loop whose trip count differs between replicas run
+    // in a single loop, up to the maximum trip count:
+    //
+    //  header:  replica PHIs, active flags, last values
+    //  guard_k: br active_k, body_k, join_k
+    //  body_k:  replica k of the original loop body
+    //  join_k:  merge replica k's values, whether it continues
+    //  latch:   br any(continue_k), header, exit
+    BasicBlock *header = region->getHeader();
+    BasicBlock *exit = region->getExiting();
+    Function *F = header->getParent();
+    LLVMContext& ctx = F->getContext();
+    Loop *loop = m_loopInfo->getLoopFor(header);
+    BasicBlock *preheader = loop->getLoopPreheader();
+
+    // Values of the loop used after it.
+    InstVector liveOuts;
+    for (Instruction& I : *header) {
+        for (User *user : I.users()) {
+            if (cast<Instruction>(user)->getParent() != header) {
+                liveOuts.push_back(&I);
+                break;
+            }
+        }
+    }
+
+    PhiVector phis = Util::getPHIs(header);
+    BasicBlock *body = header->splitBasicBlock(header->getFirstNonPHI(),
+                                               header->getName() + ".body");
+    BranchInst *branch = cast<BranchInst>(body->getTerminator());
+    bool continueOnTrue = (branch->getSuccessor(0) == header);
+
+    // Replica PHIs and bodies.
+    std::vector<ValueToValueMapTy> maps(m_factor);
+    BlockVector bodies(1, body);
+    for (unsigned int index = 1; index < m_factor; ++index) {
+        ValueToValueMapTy& vMap = maps[index];
+
+        for (PHINode *phi : phis) {
+            PHINode *replica = cast<PHINode>(phi->clone());
+            Util::renameValueWithFactor(replica, phi->getName(), index - 1);
+            replica->insertBefore(header->getFirstNonPHI());
+
+            int initIndex = replica->getBasicBlockIndex(preheader);
+            Instruction *init =
+                dyn_cast<Instruction>(replica->getIncomingValue(initIndex));
+            if (init) {
+                Instruction *coarsened =
+                            getCoarsenedInstruction(replica, init, index - 1);
+                if (coarsened) {
+                    replica->setIncomingValue(initIndex, coarsened);
+                }
+            }
+            vMap[phi] = replica;
+        }
+
+        BasicBlock *replicaBody = CloneBasicBlock(body,
+                                                  vMap,
+                                                  ".cf" + Twine(index + 1),
+                                                  F);
+        for (Instruction& I : *replicaBody) {
+            RemapInstruction(&I, vMap, RF_IgnoreMissingLocals |
+                                       RF_NoModuleLevelChanges);
+            applyCoarseningMap(&I, index - 1);
+        }
+        bodies.push_back(replicaBody);
+    }
+
+    auto replicaOf = [&maps](Value *value, unsigned int index) -> Value * {
+        if (index == 0) {
+            return value;
+        }
+        auto iter = maps[index].find(value);
+        return iter == maps[index].end() ? value : &*iter->second;
+    };
+
+    BasicBlock *latch = BasicBlock::Create(ctx, header->getName() + ".latch",
+                                           F, exit);
+    IRBuilder<> headerBuilder(header->getTerminator());
+    Value *anyContinues = nullptr;
+    BasicBlock *next = latch;
+    std::set<BasicBlock *> loopBlocks = { header, latch };
+
+    std::vector<PHINode *> liveOutsReplica0;
+    std::vector<std::vector<PHINode *>> carried(liveOuts.size());
+    std::vector<std::vector<PHINode *>> merged(liveOuts.size());
+
+    // Build the replicas back to front, so every join knows its successor.
+    for (unsigned int index = m_factor; index-- > 0; ) {
+        BasicBlock *replicaBody = bodies[index];
+        BasicBlock *guard = BasicBlock::Create(
+                                ctx,
+                                header->getName() + ".guard" + Twine(index),
+                                F,
+                                replicaBody);
+        BasicBlock *join = BasicBlock::Create(
+                                ctx,
+                                header->getName() + ".join" + Twine(index),
+                                F,
+                                next);
+
+        // Whether replica continues after this iteration.
+        BranchInst *replicaBranch =
+                            cast<BranchInst>(replicaBody->getTerminator());
+        IRBuilder<> bodyBuilder(replicaBranch);
+        Value *continues = replicaBranch->getCondition();
+        if (!continueOnTrue) {
+            continues = bodyBuilder.CreateNot(continues);
+        }
+        replicaBranch->eraseFromParent();
+        BranchInst::Create(join, replicaBody);
+
+        PHINode *active = headerBuilder.CreatePHI(Type::getInt1Ty(ctx), 2,
+                                                  "active" + Twine(index));
+        active->addIncoming(ConstantInt::getTrue(ctx), preheader);
+        BranchInst::Create(replicaBody, join, active, guard);
+
+        IRBuilder<> joinBuilder(join);
+        PHINode *joinContinues = joinBuilder.CreatePHI(Type::getInt1Ty(ctx), 2);
+        joinContinues->addIncoming(continues, replicaBody);
+        joinContinues->addIncoming(ConstantInt::getFalse(ctx), guard);
+        active->addIncoming(joinContinues, latch);
+
+        // Loop-carried values stay unchanged once the replica is done.
+        for (PHINode *phi : phis) {
+            PHINode *replicaPhi = cast<PHINode>(replicaOf(phi, index));
+            int backIndex = replicaPhi->getBasicBlockIndex(body);
+            Value *value = replicaOf(phi->getIncomingValue(backIndex), index);
+
+            PHINode *joinValue = joinBuilder.CreatePHI(phi->getType(), 2);
+            joinValue->addIncoming(value, replicaBody);
+            joinValue->addIncoming(replicaPhi, guard);
+
+            replicaPhi->setIncomingBlock(backIndex, latch);
+            replicaPhi->setIncomingValue(backIndex, joinValue);
+        }
+
+        // Values used after the loop are the ones of the last iteration
+        // the replica was active in.
+        for (unsigned int live = 0; live < liveOuts.size(); ++live) {
+            Instruction *inst = liveOuts[live];
+            PHINode *last = PHINode::Create(inst->getType(), 2,
+                                            inst->getName() + ".last",
+                                            header->getFirstNonPHI());
+            last->addIncoming(UndefValue::get(inst->getType()), preheader);
+
+            PHINode *joinValue = joinBuilder.CreatePHI(inst->getType(), 2);
+            joinValue->addIncoming(replicaOf(inst, index), replicaBody);
+            joinValue->addIncoming(last, guard);
+            last->addIncoming(joinValue, latch);
+
+            carried[live].insert(carried[live].begin(), last);
+            merged[live].insert(merged[live].begin(), joinValue);
+        }
+
+        loopBlocks.insert(guard);
+        loopBlocks.insert(replicaBody);
+        loopBlocks.insert(join);
+
+        joinBuilder.CreateBr(next);
+        next = guard;
+
+        IRBuilder<> latchBuilder(latch);
+        anyContinues = anyContinues
+                       ? latchBuilder.CreateOr(anyContinues, joinContinues)
+                       : joinContinues;
+    }
+
+    IRBuilder<> latchBuilder(latch);
+    latchBuilder.CreateCondBr(anyContinues, header, exit);
+
+    header->getTerminator()->eraseFromParent();
+    BranchInst::Create(next, header);
+
+    // Redirect the uses after the loop to the merged values of replica 0.
+    for (unsigned int live = 0; live < liveOuts.size(); ++live) {
+        Instruction *inst = liveOuts[live];
+        for (auto use = inst->use_begin(); use != inst->use_end(); ) {
+            Use& U = *use++;
+            Instruction *user = cast<Instruction>(U.getUser());
+            if (!loopBlocks.count(user->getParent())) {
+                U.set(merged[live][0]);
+            }
+        }
+    }
+
+    // Exit PHIs are now reached from the latch, one set per replica.
+    for (PHINode *phi : Util::getPHIs(exit)) {
+        int bodyIndex = phi->getBasicBlockIndex(body);
+        phi->setIncomingBlock(bodyIndex, latch);
+        Value *value = phi->getIncomingValue(bodyIndex);
+
+        InstVector replicas;
+        for (unsigned int index = 1; index < m_factor; ++index) {
+            Value *replicaValue = value;
+            for (unsigned int live = 0; live < liveOuts.size(); ++live) {
+                if (value == merged[live][0]) {
+                    replicaValue = merged[live][index];
+                }
+            }
+            if (replicaValue == value && isa<Instruction>(value)) {
+                Instruction *coarsened = getCoarsenedInstruction(
+                                                    phi,
+                                                    cast<Instruction>(value),
+                                                    index - 1);
+                if (coarsened) {
+                    replicaValue = coarsened;
+                }
+            }
+
+            PHINode *replica = PHINode::Create(phi->getType(), 1, "",
+                                               exit->getFirstNonPHI());
+            Util::renameValueWithFactor(replica, phi->getName(), index - 1);
+            replica->addIncoming(replicaValue, latch);
+            replicas.push_back(replica);
+        }
+
+        m_coarseningMap.insert(
+                        std::pair<Instruction *, InstVector>(phi, replicas));
+        updatePlaceholderMap(phi, replicas);
+    }
+
+    // Values used directly after the loop.
+    for (unsigned int live = 0; live < liveOuts.size(); ++live) {
+        InstVector replicas(merged[live].begin() + 1, merged[live].end());
+        m_coarseningMap.insert(
+                std::pair<Instruction *, InstVector>(merged[live][0],
+                                                     replicas));
+        updatePlaceholderMap(liveOuts[live], replicas);
+    }
+
+    // Keep the analyses up to date for the remaining regions.
+    for (BasicBlock *block : loopBlocks) {
+        if (block != header && !loop->contains(block)) {
+            loop->addBasicBlockToLoop(block, *m_loopInfo);
+        }
+    }
+    m_domT->recalculate(*F);
+    m_postDomT->recalculate(*F);
+
+    errs() << "--  INFO  -- Fused " << m_factor << " replicas of loop "
+           << header->getName() << "\n";
+}
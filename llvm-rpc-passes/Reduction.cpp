@@ -0,0 +1,382 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Register-level pre-reduction of shared memory tree reductions
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/Support/MathExtras.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+#include "RegionBounds.h"
+#include "DivergentRegion.h"
+#include "DivergenceAnalysisPass.h"
+#include "GridAnalysisPass.h"
+
+extern cl::opt<bool> CLCoarseningPreReduce;
+
+bool getSharedSlot(Value *pointer, GlobalVariable *&array, Value *&index)
+{
+    // Element of a shared array, 'index' is null for the first element.
+    Value *stripped = pointer->stripPointerCasts();
+    array = dyn_cast<GlobalVariable>(stripped);
+    index = nullptr;
+    if (array) {
+        return array->getType()->getAddressSpace() == 3;
+    }
+
+    GEPOperator *gep = dyn_cast<GEPOperator>(stripped);
+    if (!gep || gep->getNumIndices() != 2) {
+        return false;
+    }
+
+    ConstantInt *first = dyn_cast<ConstantInt>(gep->getOperand(1));
+    array = dyn_cast<GlobalVariable>(
+                                gep->getPointerOperand()->stripPointerCasts());
+    if (!first || !first->isZero() || !array ||
+        array->getType()->getAddressSpace() != 3) {
+        return false;
+    }
+
+    index = gep->getOperand(2);
+    if (ConstantInt *constant = dyn_cast<ConstantInt>(index)) {
+        if (constant->isZero()) {
+            index = nullptr;
+        }
+    }
+    return true;
+}
+
+Value *stripExtensions(Value *value)
+{
+    while (isa<ZExtInst>(value) || isa<SExtInst>(value)) {
+        value = cast<Instruction>(value)->getOperand(0);
+    }
+    return value;
+}
+
+bool getSlotOffset(ScalarEvolution *SE,
+                   Value           *index,
+                   Value           *base,
+                   int64_t&         offset)
+{
+    // Indices are extended to 64 bits after the arithmetic, which hides
+    // 'tid + c' from SCEV behind the extension.
+    Value *narrowIndex = stripExtensions(index);
+    Value *narrowBase = stripExtensions(base);
+    if (narrowIndex->getType() != narrowBase->getType()) {
+        return false;
+    }
+
+    const SCEV *distance = SE->getMinusSCEV(SE->getSCEV(narrowIndex),
+                                            SE->getSCEV(narrowBase));
+    const SCEVConstant *constant = dyn_cast<SCEVConstant>(distance);
+    if (!constant) {
+        return false;
+    }
+    offset = constant->getAPInt().getSExtValue();
+    return true;
+}
+
+bool isCoarsenedSlot(ScalarEvolution *SE,
+                     Value           *index,
+                     Value           *base,
+                     const InstSet&   threadDependent)
+{
+    // 'index' is the coarsened thread index 'base' plus an offset uniform
+    // across the threads, so that the replicas of a thread own consecutive
+    // elements. 'smem[2 * tid]' or 'smem[tid + tid / 2]' are rejected.
+    Value *narrowIndex = stripExtensions(index);
+    if (narrowIndex->getType() != base->getType()) {
+        return false;
+    }
+
+    const SCEV *offset = SE->getMinusSCEV(SE->getSCEV(narrowIndex),
+                                          SE->getSCEV(base));
+    return !SCEVExprContains(offset, [&](const SCEV *expr) {
+        if (isa<SCEVAddRecExpr>(expr) || isa<SCEVCouldNotCompute>(expr)) {
+            return true;
+        }
+        const SCEVUnknown *unknown = dyn_cast<SCEVUnknown>(expr);
+        Instruction *inst =
+                unknown ? dyn_cast<Instruction>(unknown->getValue()) : nullptr;
+        return inst && threadDependent.count(inst);
+    });
+}
+
+bool isReductionOperator(BinaryOperator *op)
+{
+    switch (op->getOpcode()) {
+      case Instruction::Add:
+      case Instruction::Mul:
+      case Instruction::And:
+      case Instruction::Or:
+      case Instruction::Xor:
+        return true;
+      case Instruction::FAdd:
+      case Instruction::FMul:
+        return op->hasAllowReassoc();
+      default:
+        return false;
+    }
+}
+
+void CUDACoarseningPass::findTreeReductions(Function& F)
+{
+    // Recognizes 'smem[tid] = v' followed by an in-place tree reduction,
+    // 'if (tid < c) smem[tid] = smem[tid] op smem[tid + c]'. With stride-1
+    // thread coarsening, the replicas of a coarsened thread own 'factor'
+    // consecutive elements. Their values are combined in registers and
+    // stored to the first one, the tree then only needs the elements that
+    // are multiples of 'factor': the replicas of the tree statements and
+    // the last log2(factor) levels (c < factor) are dropped.
+    m_reductionInsts.clear();
+    m_reductionSeeds.clear();
+
+    if (!CLCoarseningPreReduce || hasReplicaGuards() || m_blockLevel ||
+        m_stride != 1 || !isPowerOf2_32(m_factor)) {
+        return;
+    }
+
+    ScalarEvolution *SE =
+                    &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+    const DataLayout& DL = F.getParent()->getDataLayout();
+
+    // Coarsened thread indices: the grid scaling maps each of them to the
+    // indices of the replicas, no other instruction is replicated yet.
+    InstVector bases;
+    for (auto& mapIter : m_coarseningMap) {
+        if (!mapIter.second.empty()) {
+            bases.push_back(mapIter.first);
+        }
+    }
+
+    InstVector tids = m_gridAnalysis->getThreadIDDependentInstructions();
+    InstSet threadDependent(tids.begin(), tids.end());
+    InstVector divergent = m_divergenceAnalysisTL->getInstructions();
+    threadDependent.insert(divergent.begin(), divergent.end());
+    threadDependent.insert(bases.begin(), bases.end());
+
+    InstVector insts = m_divergenceAnalysisTL->getOutermostInstructions();
+    for (Instruction *inst : insts) {
+        StoreInst *seed = dyn_cast<StoreInst>(inst);
+        GlobalVariable *array = nullptr;
+        Value *seedIndex = nullptr;
+        if (!seed || !seed->isSimple() ||
+            !getSharedSlot(seed->getPointerOperand(),
+                           array,
+                           seedIndex) || !seedIndex) {
+            continue;
+        }
+
+        bool coarsened = false;
+        for (Instruction *base : bases) {
+            coarsened |= isCoarsenedSlot(SE, seedIndex, base, threadDependent);
+        }
+        if (!coarsened) {
+            continue;
+        }
+
+        // The array is private to this kernel.
+        bool isPrivate = true;
+        for (User *user : array->users()) {
+            if (Instruction *userInst = dyn_cast<Instruction>(user)) {
+                isPrivate &= (userInst->getFunction() == &F);
+            }
+        }
+        if (!isPrivate || m_reductionSeeds.count(seed)) {
+            continue;
+        }
+
+        // Every access of the array is either the seed, a tree statement,
+        // or a read of the result in the first element.
+        std::vector<std::pair<StoreInst *, int64_t>> statements;
+        InstVector treeLoads;
+        unsigned int opcode = 0;
+        bool matches = true;
+
+        for (BasicBlock& B : F) {
+            for (Instruction& I : B) {
+                if (&I == seed || !matches) {
+                    continue;
+                }
+
+                Value *pointer = getLoadStorePointerOperand(&I);
+                if (!pointer) {
+                    for (Value *operand : I.operands()) {
+                        if (operand->getType()->isPointerTy() &&
+                            !isa<GetElementPtrInst>(I) && !isa<CastInst>(I) &&
+                            GetUnderlyingObject(operand, DL) == array) {
+                            matches = false;
+                        }
+                    }
+                    continue;
+                }
+                if (GetUnderlyingObject(pointer, DL) != array) {
+                    continue;
+                }
+
+                // Volatile accesses must stay as they are.
+                LoadInst *read = dyn_cast<LoadInst>(&I);
+                StoreInst *store = dyn_cast<StoreInst>(&I);
+                if ((read && !read->isSimple()) ||
+                    (store && !store->isSimple())) {
+                    matches = false;
+                    continue;
+                }
+
+                GlobalVariable *other = nullptr;
+                Value *index = nullptr;
+                if (!getSharedSlot(pointer, other, index) || other != array) {
+                    matches = false;
+                    continue;
+                }
+
+                if (isa<LoadInst>(I)) {
+                    if (index) {
+                        matches = I.hasOneUse();
+                        treeLoads.push_back(&I);
+                    }
+                    continue;
+                }
+
+                int64_t offset = -1;
+                BinaryOperator *op =
+                        dyn_cast<BinaryOperator>(store->getValueOperand());
+                if (!index ||
+                    !getSlotOffset(SE, index, seedIndex, offset) ||
+                    offset != 0 || !op || !op->hasOneUse() ||
+                    !isReductionOperator(op) ||
+                    (opcode && op->getOpcode() != opcode)) {
+                    matches = false;
+                    continue;
+                }
+                opcode = op->getOpcode();
+
+                // smem[tid] op smem[tid + c], in either order.
+                int64_t offsets[2] = { -1, -1 };
+                for (unsigned int side = 0; side < 2; ++side) {
+                    LoadInst *load = dyn_cast<LoadInst>(op->getOperand(side));
+                    GlobalVariable *loadArray = nullptr;
+                    Value *loadIndex = nullptr;
+                    if (!load || load->getParent() != &B ||
+                        !getSharedSlot(load->getPointerOperand(),
+                                       loadArray,
+                                       loadIndex) ||
+                        loadArray != array || !loadIndex ||
+                        !getSlotOffset(SE, loadIndex, seedIndex,
+                                       offsets[side])) {
+                        matches = false;
+                    }
+                }
+
+                int64_t distance = std::max(offsets[0], offsets[1]);
+                if (std::min(offsets[0], offsets[1]) != 0 ||
+                    !isPowerOf2_64(distance)) {
+                    matches = false;
+                    continue;
+                }
+                statements.push_back(std::make_pair(store, distance));
+            }
+        }
+
+        // Tree loads feed the tree statements only.
+        for (Instruction *load : treeLoads) {
+            Instruction *user = cast<Instruction>(*load->user_begin());
+            bool found = false;
+            for (auto& statement : statements) {
+                found |= (statement.first->getValueOperand() == user);
+            }
+            matches &= found;
+        }
+
+        if (!matches || statements.empty()) {
+            continue;
+        }
+
+        m_reductionSeeds[seed] = opcode;
+        unsigned int removed = 0;
+
+        for (auto& statement : statements) {
+            StoreInst *store = statement.first;
+            Instruction *op = cast<Instruction>(store->getValueOperand());
+            InstVector parts = { store,
+                                 op,
+                                 cast<Instruction>(op->getOperand(0)),
+                                 cast<Instruction>(op->getOperand(1)) };
+
+            if (statement.second >= m_factor) {
+                m_reductionInsts.insert(parts.begin(), parts.end());
+                continue;
+            }
+
+            // Levels below the factor were done in registers.
+            ++removed;
+            for (Instruction *part : parts) {
+                m_divergenceAnalysisTL->replaceInstruction(part, nullptr);
+                part->replaceAllUsesWith(UndefValue::get(part->getType()));
+                part->eraseFromParent();
+            }
+        }
+
+        errs() << "--  INFO  -- Pre-reducing " << array->getName()
+               << " in registers, " << removed
+               << " tree statements removed\n";
+    }
+}
+
+void CUDACoarseningPass::preReduceStore(StoreInst *seed, unsigned int opcode)
+{
+    Value *value = seed->getValueOperand();
+
+    IRBuilder<> builder(seed);
+    Value *combined = value;
+    for (unsigned int index = 0; index < m_factor - 1; ++index) {
+        Value *replica = value;
+        if (Instruction *inst = dyn_cast<Instruction>(value)) {
+            Instruction *coarsened =
+                                getCoarsenedInstruction(seed, inst, index);
+            if (coarsened) {
+                replica = coarsened;
+            }
+        }
+        combined = builder.CreateBinOp((Instruction::BinaryOps) opcode,
+                                       combined,
+                                       replica,
+                                       value->getName() + ".reduced");
+    }
+    seed->setOperand(0, combined);
+}
+
+bool CUDACoarseningPass::isReductionRegion(DivergentRegion *region) const
+{
+    if (m_reductionInsts.empty()) {
+        return false;
+    }
+
+    BlockVector& blocks = region->getBlocks();
+    for (BasicBlock *block : blocks) {
+        for (Instruction& I : *block) {
+            if ((I.mayWriteToMemory() || I.mayHaveSideEffects()) &&
+                !m_reductionInsts.count(&I)) {
+                return false;
+            }
+            for (User *user : I.users()) {
+                Instruction *userInst = cast<Instruction>(user);
+                if (!isPresent(userInst->getParent(), blocks)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
@@ -9,7 +9,11 @@
 #include <llvm/Pass.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/ValueTracking.h>
 
 #include "Common.h"
 #include "CUDACoarsening.h"
@@ -21,6 +25,10 @@
 
 #include <utility>
 
+extern cl::opt<std::string> CLCoarseningRegionMode;
+extern cl::opt<unsigned int> CLCoarseningMergeThreshold;
+extern cl::opt<bool> CLCoarseningSplitBarriers;
+
 void CUDACoarseningPass::replicateRegion(DivergentRegion *region)
 {
     assert(m_domT->dominates(region->getHeader(), region->getExiting()) &&
@@ -28,9 +36,226 @@ void CUDACoarseningPass::replicateRegion(DivergentRegion *region)
     assert(m_postDomT->dominates(region->getExiting(), region->getHeader()) &&
          "Exiting does not post dominate Header");
 
+    if (isReductionRegion(region)) {
+        return;
+    }
+
+    if (isFusibleLoop(region)) {
+        replicateLoopFused(region);
+        return;
+    }
+
+    if (Instruction *barrier = findSplitBarrier(region)) {
+        replicateRegionAtBarrier(region, barrier);
+        return;
+    }
+
     replicateRegionClassic(region);
 }
 
+Instruction *CUDACoarseningPass::findSplitBarrier(
+                                            DivergentRegion *region) const
+{
+    // The region can be split at a barrier every path through the region
+    // executes, outside of the loops nested in the region.
+    BasicBlock *header = region->getHeader();
+    BasicBlock *exiting = region->getExiting();
+    bool hasBarrier = false;
+
+    for (BasicBlock *block : region->getBlocks()) {
+        for (Instruction& I : *block) {
+            if (!Util::isBarrier(&I)) {
+                continue;
+            }
+            hasBarrier = true;
+
+            if (CLCoarseningSplitBarriers &&
+                !m_loopInfo->isLoopHeader(header) &&
+                m_loopInfo->getLoopFor(block) ==
+                                        m_loopInfo->getLoopFor(header) &&
+                m_postDomT->dominates(block, header) &&
+                m_domT->dominates(block, exiting)) {
+                return &I;
+            }
+        }
+    }
+
+    if (hasBarrier) {
+        errs() << "--  WARN  -- Region " << header->getName()
+               << " contains a barrier, which is replicated\n";
+    }
+    return nullptr;
+}
+
+void CUDACoarseningPass::replicateRegionAtBarrier(DivergentRegion *region,
+                                                  Instruction     *barrier)
+{
+    // The region is split into the part before and the part after the
+    // barrier, which are replicated separately. The replicas of the first
+    // part all run before the (single) barrier, the replicas of the second
+    // part after it:
+    //
+    //  before.cf2 ... before -> barrier -> after.cf2 ... after
+    BasicBlock *block = barrier->getParent();
+    BasicBlock *header = region->getHeader();
+    BasicBlock *exiting = region->getExiting();
+    Function *F = header->getParent();
+
+    BasicBlock *barrierBlock =
+            block->splitBasicBlock(barrier, block->getName() + ".barrier");
+    BasicBlock *after =
+            barrierBlock->splitBasicBlock(barrier->getNextNode(),
+                                          block->getName() + ".after");
+
+    if (Loop *loop = m_loopInfo->getLoopFor(block)) {
+        loop->addBasicBlockToLoop(barrierBlock, *m_loopInfo);
+        loop->addBasicBlockToLoop(after, *m_loopInfo);
+    }
+    m_domT->recalculate(*F);
+    m_postDomT->recalculate(*F);
+
+    if (exiting == block) {
+        exiting = after;
+    }
+
+    // Values crossing the barrier are passed to the replicas of the second
+    // part through the alive map.
+    DivergentRegion before(header, block);
+    before.findAliveValues();
+    replicateRegion(&before);
+
+    DivergentRegion rest(after, exiting);
+    rest.findAliveValues();
+    replicateRegion(&rest);
+}
+
+void CUDACoarseningPass::mergeRegions()
+{
+    // In merged mode, small if-then(-else) regions are flattened into
+    // straight-line code before replication: both sides are speculated and
+    // the PHIs become selects on the branch condition. The instructions are
+    // then replicated one by one, so the replicas interleave in a single
+    // block instead of executing factor-times chained copies of the region.
+    if (CLCoarseningRegionMode != "merged") {
+        return;
+    }
+
+    DivergenceAnalysisPass *divergence = m_divergenceAnalysisTL;
+    if (m_blockLevel) {
+        divergence = m_divergenceAnalysisBL;
+    }
+
+    RegionVector regions = divergence->getOutermostRegions();
+    for (DivergentRegion *region : regions) {
+        if (isMergeable(region)) {
+            mergeRegion(region, divergence);
+        }
+    }
+}
+
+bool CUDACoarseningPass::isMergeable(DivergentRegion *region) const
+{
+    BasicBlock *header = region->getHeader();
+    BasicBlock *exiting = region->getExiting();
+
+    BranchInst *branch = dyn_cast<BranchInst>(header->getTerminator());
+    if (!branch || !branch->isConditional() ||
+        branch->getSuccessor(0) == branch->getSuccessor(1)) {
+        return false;
+    }
+
+    if (m_loopInfo->isLoopHeader(header) ||
+        std::distance(pred_begin(exiting), pred_end(exiting)) != 2) {
+        return false;
+    }
+
+    // Every side is either empty, or a single block with no side effects.
+    unsigned int size = 0;
+    unsigned int sides = 0;
+    for (BasicBlock *side : branch->successors()) {
+        if (side == exiting) {
+            continue;
+        }
+
+        if (side->getSinglePredecessor() != header ||
+            side->getSingleSuccessor() != exiting) {
+            return false;
+        }
+
+        for (Instruction& I : *side) {
+            if (I.isTerminator()) {
+                continue;
+            }
+            if (isa<PHINode>(I) || isa<CallInst>(I) ||
+                !isSafeToSpeculativelyExecute(&I)) {
+                return false;
+            }
+            ++size;
+        }
+        ++sides;
+    }
+
+    if (region->getBlocks().size() != sides + 2) {
+        return false;
+    }
+
+    return size <= CLCoarseningMergeThreshold;
+}
+
+void CUDACoarseningPass::mergeRegion(DivergentRegion        *region,
+                                     DivergenceAnalysisPass *divergence)
+{
+    BasicBlock *header = region->getHeader();
+    BasicBlock *exiting = region->getExiting();
+    BranchInst *branch = cast<BranchInst>(header->getTerminator());
+    Value *condition = branch->getCondition();
+
+    // Blocks the exiting PHIs receive the values from.
+    BasicBlock *incoming[2];
+    BlockVector sides;
+    for (unsigned int index = 0; index < 2; ++index) {
+        BasicBlock *side = branch->getSuccessor(index);
+        incoming[index] = (side == exiting) ? header : side;
+        if (side != exiting) {
+            sides.push_back(side);
+        }
+    }
+
+    // PHIs become selects.
+    IRBuilder<> builder(&*exiting->getFirstInsertionPt());
+    for (PHINode *phi : Util::getPHIs(exiting)) {
+        Value *select = builder.CreateSelect(
+                                condition,
+                                phi->getIncomingValueForBlock(incoming[0]),
+                                phi->getIncomingValueForBlock(incoming[1]),
+                                phi->getName() + ".merged");
+        phi->replaceAllUsesWith(select);
+        divergence->replaceInstruction(phi, dyn_cast<Instruction>(select));
+        phi->eraseFromParent();
+    }
+
+    // Speculate the sides in the header.
+    for (BasicBlock *side : sides) {
+        while (&side->front() != side->getTerminator()) {
+            side->front().moveBefore(branch);
+        }
+    }
+
+    BranchInst::Create(exiting, branch);
+    divergence->replaceInstruction(branch, nullptr);
+    branch->eraseFromParent();
+
+    for (BasicBlock *side : sides) {
+        m_loopInfo->removeBlock(side);
+        m_domT->eraseNode(side);
+        m_postDomT->eraseNode(side);
+        side->eraseFromParent();
+    }
+
+    divergence->removeRegion(region);
+    delete region;
+}
+
 void CUDACoarseningPass::replicateRegionClassic(DivergentRegion *region)
 {
     CoarseningMap aliveMap;
@@ -91,6 +316,15 @@ void CUDACoarseningPass::replicateRegionImpl(DivergentRegion *region,
 
     //errs() << "pred :" << pred->getName() << "\n";
 
+    // Guarded replicas are wrapped in a bounds check once coarsened, the
+    // replicas of block-level coarsening prefetch for each other.
+    if (recordsReplicaRegions()) {
+        m_replicaRegions.emplace_back(
+                    new DivergentRegion(region->getHeader(),
+                                        region->getExiting()),
+                    0);
+    }
+
     // Replicate the region.
     for (unsigned int index = 0; index < m_factor - 1; ++index) {
         Map valueMap;
@@ -154,7 +388,12 @@ void CUDACoarseningPass::replicateRegionImpl(DivergentRegion *region,
             firstDuplicate = newRegion->getExiting();
         }
 
-        delete newRegion;
+        if (recordsReplicaRegions()) {
+            m_replicaRegions.emplace_back(newRegion, index + 1);
+        }
+        else {
+            delete newRegion;
+        }
         updateAliveMap(aliveMap, valueMap);
     }
 }
\ No newline at end of file
@@ -0,0 +1,274 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Memory-level parallelism scheduling of replicated loads
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+#include "RegionBounds.h"
+#include "DivergentRegion.h"
+
+#define PREFETCH_MAX_DEPTH 8 /* Instructions of an address cloned at most */
+
+extern cl::opt<bool> CLCoarseningSchedule;
+extern cl::opt<unsigned int> CLCoarseningScheduleRegs;
+extern cl::opt<unsigned int> CLCoarseningPrefetch;
+
+void CUDACoarseningPass::scheduleReplicas(Function& F)
+{
+    // Replicas are emitted right after their originals, so every load is
+    // directly followed by the arithmetic depending on it. Hoist the
+    // replicated loads as early as their operands and the surrounding
+    // memory effects allow, to have all of them in flight together.
+    if (!CLCoarseningSchedule || m_factor < 2) {
+        return;
+    }
+
+    const DataLayout& DL = F.getParent()->getDataLayout();
+
+    InstSet candidates;
+    for (auto& mapIter : m_coarseningMap) {
+        if (isa<LoadInst>(mapIter.first)) {
+            candidates.insert(mapIter.first);
+        }
+        for (Instruction *replica : mapIter.second) {
+            if (isa<LoadInst>(replica)) {
+                candidates.insert(replica);
+            }
+        }
+    }
+
+    unsigned int hoisted = 0;
+
+    for (BasicBlock& B : F) {
+        // Loads in the block, in program order.
+        std::vector<LoadInst *> loads;
+        for (Instruction& I : B) {
+            LoadInst *load = dyn_cast<LoadInst>(&I);
+            if (load && load->isSimple() && candidates.count(load)) {
+                loads.push_back(load);
+            }
+        }
+
+        // Registers (32-bit) held by the loads hoisted into the current
+        // window between two instructions with memory side effects.
+        unsigned int pressure = 0;
+        Instruction *window = nullptr;
+
+        for (LoadInst *load : loads) {
+            // Find the earliest legal position.
+            Instruction *stop = nullptr;
+            for (Instruction *prev = load->getPrevNode();
+                 prev != nullptr;
+                 prev = prev->getPrevNode()) {
+                bool isOperand = std::find(load->op_begin(),
+                                           load->op_end(),
+                                           prev) != load->op_end();
+                if (isOperand ||
+                    isa<PHINode>(prev) ||
+                    prev->mayWriteToMemory() ||
+                    prev->mayHaveSideEffects() ||
+                    (isa<LoadInst>(prev) && candidates.count(prev))) {
+                    stop = prev;
+                    break;
+                }
+            }
+
+            // Instructions with memory side effects delimit the windows,
+            // reset the pressure once the load is in a new one.
+            Instruction *barrier = stop;
+            while (barrier && !barrier->mayWriteToMemory() &&
+                   !barrier->mayHaveSideEffects()) {
+                barrier = barrier->getPrevNode();
+            }
+            if (barrier != window) {
+                window = barrier;
+                pressure = 0;
+            }
+
+            unsigned int regs =
+                    (DL.getTypeStoreSize(load->getType()) + 3) / 4;
+            if (pressure + regs > CLCoarseningScheduleRegs) {
+                // Hoisting further would risk spilling.
+                continue;
+            }
+
+            if (stop == load->getPrevNode()) {
+                // Already at the earliest position.
+                pressure += regs;
+                continue;
+            }
+
+            if (stop) {
+                load->moveAfter(stop);
+            }
+            else {
+                load->moveBefore(&*B.getFirstInsertionPt());
+            }
+
+            pressure += regs;
+            ++hoisted;
+        }
+    }
+
+    if (hoisted) {
+        errs() << "--  INFO  -- Hoisted " << hoisted
+               << " replicated loads\n";
+    }
+}
+
+bool CUDACoarseningPass::recordsReplicaRegions() const
+{
+    return hasReplicaGuards() || (CLCoarseningPrefetch && m_blockLevel);
+}
+
+Value *cloneAddress(Value           *value,
+                    DivergentRegion *region,
+                    Instruction     *insertBefore,
+                    DominatorTree   *DT,
+                    Map&             cloned,
+                    unsigned int     depth)
+{
+    // Recomputes 'value' of the 'region' at 'insertBefore', outside of the
+    // region. Only side effect free instructions are cloned, returns null
+    // if the value depends on anything else of the region, or on values
+    // not available at 'insertBefore'.
+    Instruction *inst = dyn_cast<Instruction>(value);
+    if (!inst) {
+        return value;
+    }
+    if (!contains(*region, inst)) {
+        return DT->dominates(inst, insertBefore) ? value : nullptr;
+    }
+    if (cloned.count(inst)) {
+        return cloned[inst];
+    }
+    if (depth == 0 ||
+        !(isa<BinaryOperator>(inst) || isa<CastInst>(inst) ||
+          isa<GetElementPtrInst>(inst) || isa<CmpInst>(inst) ||
+          isa<SelectInst>(inst))) {
+        return nullptr;
+    }
+
+    Instruction *copy = inst->clone();
+    for (unsigned int i = 0; i < inst->getNumOperands(); ++i) {
+        Value *operand = cloneAddress(inst->getOperand(i),
+                                      region,
+                                      insertBefore,
+                                      DT,
+                                      cloned,
+                                      depth - 1);
+        if (!operand) {
+            copy->deleteValue();
+            return nullptr;
+        }
+        copy->setOperand(i, operand);
+    }
+    copy->setName(inst->getName() + ".pf");
+    copy->insertBefore(insertBefore);
+    cloned[inst] = copy;
+    return copy;
+}
+
+void CUDACoarseningPass::prefetchReplicas(Function& F)
+{
+    // Replicas of a divergent region run one after another, each issuing
+    // its global loads only once it starts. Software-pipeline them: on
+    // entry, a replica prefetches the addresses the replica running next
+    // loads in its header, so that the lines are on their way to L2 while
+    // the current replica computes. The prefetch is a hint and never
+    // faults, the addresses of an inactive replica are harmless.
+    if (!CLCoarseningPrefetch || !m_blockLevel || m_replicaRegions.empty()) {
+        return;
+    }
+
+    Module& M = *F.getParent();
+    const DataLayout& DL = M.getDataLayout();
+    LLVMContext& ctx = F.getContext();
+    m_domT->recalculate(F);
+
+    Type *pointerType = Type::getInt8PtrTy(ctx);
+    InlineAsm *prefetch = InlineAsm::get(
+                FunctionType::get(Type::getVoidTy(ctx), { pointerType }, false),
+                "prefetch.L2 [$0];",
+                "l",
+                true);
+
+    unsigned int prefetched = 0;
+    for (unsigned int i = 0; i < m_replicaRegions.size(); ++i) {
+        // Replicas of a region are recorded from the original (0) on, and
+        // run in the opposite order, the original last.
+        unsigned int owner = m_replicaRegions[i].second;
+        if (owner == 0) {
+            continue;
+        }
+
+        DivergentRegion *current = m_replicaRegions[i].first.get();
+        DivergentRegion *next = m_replicaRegions[i - 1].first.get();
+        BasicBlock *header = current->getHeader();
+        Loop *loop = m_loopInfo->getLoopFor(header);
+        if (loop && loop->getHeader() == header) {
+            // Would prefetch on every iteration.
+            continue;
+        }
+
+        Instruction *point = &*header->getFirstInsertionPt();
+        Map cloned;
+        unsigned int issued = 0;
+        for (Instruction& I : *next->getHeader()) {
+            LoadInst *load = dyn_cast<LoadInst>(&I);
+            if (!load || issued >= CLCoarseningPrefetch) {
+                continue;
+            }
+
+            // Global memory only.
+            Value *pointer = load->getPointerOperand();
+            unsigned int addressSpace = pointer->getType()
+                                               ->getPointerAddressSpace();
+            Value *object = GetUnderlyingObject(pointer, DL);
+            GlobalVariable *gv = dyn_cast<GlobalVariable>(object);
+            if ((addressSpace != 0 && addressSpace != 1) ||
+                isa<AllocaInst>(object) ||
+                (gv && gv->getType()->getAddressSpace() != 1 &&
+                 gv->getType()->getAddressSpace() != 0)) {
+                continue;
+            }
+
+            Value *address = cloneAddress(pointer,
+                                          next,
+                                          point,
+                                          m_domT,
+                                          cloned,
+                                          PREFETCH_MAX_DEPTH);
+            if (!address || isa<Constant>(address)) {
+                continue;
+            }
+
+            IRBuilder<> builder(point);
+            builder.CreateCall(
+                    prefetch,
+                    { builder.CreatePointerBitCastOrAddrSpaceCast(
+                                                    address,
+                                                    pointerType) });
+            ++issued;
+        }
+        prefetched += issued;
+    }
+
+    if (prefetched) {
+        errs() << "--  INFO  -- Prefetching " << prefetched
+               << " global loads of the next replicas\n";
+    }
+}
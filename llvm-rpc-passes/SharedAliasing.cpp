@@ -0,0 +1,359 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Lifetime-based aliasing of shared memory arrays
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Support/MathExtras.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+
+extern cl::opt<bool> CLCoarseningSmemAliasing;
+
+bool isExecutedOnce(BasicBlock        *block,
+                    DominatorTree     *DT,
+                    PostDominatorTree *PDT,
+                    LoopInfo          *LI)
+{
+    // Every thread executes the 'block' exactly once: the block is outside
+    // of loops, post-dominates the entry, and dominates the exits.
+    Function& F = *block->getParent();
+    if (LI->getLoopFor(block) || !PDT->dominates(block, &F.getEntryBlock())) {
+        return false;
+    }
+
+    for (BasicBlock& B : F) {
+        if (isa<ReturnInst>(B.getTerminator()) && !DT->dominates(block, &B)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+InstVector findPhaseBarriers(Function&          F,
+                             DominatorTree     *DT,
+                             PostDominatorTree *PDT,
+                             LoopInfo          *LI)
+{
+    // Barriers every thread passes exactly once. They split the kernel into
+    // phases, no thread accesses the shared memory of a phase once another
+    // thread is past the barrier ending it.
+    InstVector barriers;
+    for (BasicBlock& B : F) {
+        if (!isExecutedOnce(&B, DT, PDT, LI)) {
+            continue;
+        }
+
+        for (Instruction& I : B) {
+            if (Util::isBarrier(&I)) {
+                barriers.push_back(&I);
+            }
+        }
+    }
+    return barriers;
+}
+
+bool findSharedRange(GlobalVariable *gv,
+                     Function&       F,
+                     InstVector&     barriers,
+                     DominatorTree  *DT,
+                     SharedRange&    range)
+{
+    // Phases of the instructions of F using the array, directly or through
+    // derived pointers. Returns false if the array is not used in F, the
+    // range covers the whole kernel if the pointer escapes.
+    range.gv = gv;
+    range.first = ~0u;
+    range.last = 0;
+
+    std::vector<Value *> worklist = { gv };
+    std::set<Value *> visited;
+    bool escapes = false;
+    while (!worklist.empty()) {
+        Value *value = worklist.back();
+        worklist.pop_back();
+        if (!visited.insert(value).second) {
+            continue;
+        }
+
+        for (User *user : value->users()) {
+            Instruction *inst = dyn_cast<Instruction>(user);
+            if (!inst) {
+                if (isa<ConstantExpr>(user)) {
+                    worklist.push_back(user);
+                }
+                else {
+                    escapes = true;
+                }
+                continue;
+            }
+            if (inst->getFunction() != &F) {
+                // Other kernels have their own shared memory, device
+                // functions called by F would keep using the array.
+                if (!Util::isKernelFunction(*inst->getFunction())) {
+                    escapes = true;
+                }
+                continue;
+            }
+
+            unsigned int phase = 0;
+            for (Instruction *barrier : barriers) {
+                phase += DT->dominates(barrier, inst) ? 1 : 0;
+            }
+            range.first = std::min(range.first, phase);
+            range.last = std::max(range.last, phase);
+
+            // Callees may keep the pointer or access the array at any time.
+            StoreInst *store = dyn_cast<StoreInst>(inst);
+            if ((store && store->getValueOperand() == value) ||
+                isa<PtrToIntInst>(inst) || isa<CallInst>(inst)) {
+                escapes = true;
+            }
+            else if (isa<GetElementPtrInst>(inst) || isa<CastInst>(inst) ||
+                     isa<PHINode>(inst) || isa<SelectInst>(inst)) {
+                worklist.push_back(inst);
+            }
+        }
+    }
+
+    if (range.first == ~0u) {
+        return false;
+    }
+    if (escapes) {
+        range.first = 0;
+        range.last = ~0u;
+    }
+    return true;
+}
+
+uint64_t allocateShared(std::vector<SharedRange>& ranges)
+{
+    // First fit, largest arrays first. Arrays share storage only if their
+    // live ranges are disjoint. Returns the size of the pool.
+    std::sort(ranges.begin(),
+              ranges.end(),
+              [](const SharedRange& a, const SharedRange& b) {
+                  return a.size > b.size;
+              });
+
+    uint64_t poolSize = 0;
+    for (unsigned int i = 0; i < ranges.size(); ++i) {
+        SharedRange& range = ranges[i];
+        range.offset = 0;
+
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (unsigned int j = 0; j < i; ++j) {
+                SharedRange& placed = ranges[j];
+                if (placed.last < range.first || range.last < placed.first ||
+                    placed.offset + placed.size <= range.offset ||
+                    range.offset + range.size <= placed.offset) {
+                    continue;
+                }
+                range.offset = alignTo(placed.offset + placed.size,
+                                       range.alignment);
+                moved = true;
+            }
+        }
+        poolSize = std::max(poolSize, range.offset + range.size);
+    }
+    return poolSize;
+}
+
+Constant *replaceInConstant(Constant       *constant,
+                            GlobalVariable *gv,
+                            Constant       *replacement)
+{
+    // Rebuilds the constant expression with 'gv' replaced.
+    if (constant == gv) {
+        return replacement;
+    }
+
+    ConstantExpr *expr = dyn_cast<ConstantExpr>(constant);
+    if (!expr) {
+        return constant;
+    }
+
+    SmallVector<Constant *, 4> operands;
+    bool changed = false;
+    for (Value *operand : expr->operands()) {
+        Constant *newOperand = replaceInConstant(cast<Constant>(operand),
+                                                 gv,
+                                                 replacement);
+        changed |= (newOperand != operand);
+        operands.push_back(newOperand);
+    }
+    return changed ? expr->getWithOperands(operands) : constant;
+}
+
+bool CUDACoarseningPass::findSharedRanges(Function&                 F,
+                                          std::vector<SharedRange>& ranges)
+{
+    ranges.clear();
+
+    DominatorTree *DT =
+                &getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+    PostDominatorTree *PDT =
+                &getAnalysis<PostDominatorTreeWrapperPass>(F).getPostDomTree();
+    LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+    InstVector barriers = findPhaseBarriers(F, DT, PDT, LI);
+
+    const DataLayout& DL = F.getParent()->getDataLayout();
+    for (GlobalVariable& gv : F.getParent()->globals()) {
+        if (gv.getType()->getAddressSpace() != 3) {
+            continue;
+        }
+
+        SharedRange range;
+        if (!findSharedRange(&gv, F, barriers, DT, range)) {
+            continue;
+        }
+
+        Type *elementType = gv.getValueType();
+        while (ArrayType *arrayType = dyn_cast<ArrayType>(elementType)) {
+            elementType = arrayType->getElementType();
+        }
+        range.size = DL.getTypeAllocSize(gv.getValueType());
+        range.alignment = std::max<uint64_t>(
+                                gv.getAlignment(),
+                                DL.getABITypeAlignment(elementType));
+        range.offset = 0;
+        ranges.push_back(range);
+    }
+
+    return barriers.size() > 0;
+}
+
+uint64_t CUDACoarseningPass::sharedFootprint(Function& F, unsigned int factor)
+{
+    // Shared memory of F once its divergent arrays are replicated 'factor'
+    // times. The replicas of an array live as long as the array itself.
+    std::vector<SharedRange> ranges;
+    bool phased = findSharedRanges(F, ranges);
+
+    uint64_t footprint = 0;
+    for (SharedRange& range : ranges) {
+        if (m_divergentGlobals.count(range.gv)) {
+            range.size *= factor;
+        }
+        footprint += range.size;
+    }
+
+    if (!CLCoarseningSmemAliasing || !phased) {
+        return footprint;
+    }
+    return allocateShared(ranges);
+}
+
+uint64_t CUDACoarseningPass::sharedUsage(Function& F)
+{
+    // Static shared memory of F as laid out, once coarsened and aliased.
+    std::vector<SharedRange> ranges;
+    findSharedRanges(F, ranges);
+
+    uint64_t usage = 0;
+    for (SharedRange& range : ranges) {
+        usage += range.size;
+    }
+    return usage;
+}
+
+void CUDACoarseningPass::aliasSharedArrays(Function& F)
+{
+    // Shared arrays (and replicas of them) whose live ranges are disjoint
+    // are placed at the same offset of one pool. Coarsened blocks multiply
+    // the shared memory of the kernel, which would otherwise lower the
+    // occupancy or exceed the limit at higher factors.
+    if (!CLCoarseningSmemAliasing) {
+        return;
+    }
+
+    std::vector<SharedRange> ranges;
+    if (!findSharedRanges(F, ranges)) {
+        return;
+    }
+
+    // Escaping arrays and dynamic shared memory keep their own storage.
+    uint64_t footprint = 0;
+    std::vector<SharedRange> pooled;
+    for (SharedRange& range : ranges) {
+        if (range.last != ~0u && range.size > 0 &&
+            range.gv->hasInitializer() &&
+            isa<UndefValue>(range.gv->getInitializer())) {
+            footprint += range.size;
+            pooled.push_back(range);
+        }
+    }
+
+    uint64_t poolSize = allocateShared(pooled);
+    if (pooled.size() < 2 || poolSize >= footprint) {
+        return;
+    }
+
+    Module& M = *F.getParent();
+    LLVMContext& ctx = M.getContext();
+    ArrayType *poolType = ArrayType::get(Type::getInt8Ty(ctx), poolSize);
+    GlobalVariable *pool = new GlobalVariable(
+                               M,
+                               poolType,
+                               false,
+                               GlobalValue::InternalLinkage,
+                               UndefValue::get(poolType),
+                               F.getName() + ".smem",
+                               (GlobalVariable *) nullptr,
+                               GlobalValue::NotThreadLocal,
+                               3);
+    uint64_t poolAlignment = 1;
+    for (SharedRange& range : pooled) {
+        poolAlignment = std::max(poolAlignment, range.alignment);
+    }
+    pool->setAlignment(poolAlignment);
+
+    errs() << "--  INFO  -- Aliasing " << pooled.size()
+           << " shared arrays of " << F.getName() << ", " << footprint
+           << " B -> " << poolSize << " B\n";
+
+    IntegerType *indexType = Type::getInt64Ty(ctx);
+    for (SharedRange& range : pooled) {
+        Constant *indices[] = { ConstantInt::get(indexType, 0),
+                                ConstantInt::get(indexType, range.offset) };
+        Constant *pointer = ConstantExpr::getPointerCast(
+                    ConstantExpr::getInBoundsGetElementPtr(poolType,
+                                                           pool,
+                                                           indices),
+                    range.gv->getType());
+
+        for (BasicBlock& B : F) {
+            for (Instruction& I : B) {
+                for (unsigned int i = 0; i < I.getNumOperands(); ++i) {
+                    Constant *operand = dyn_cast<Constant>(I.getOperand(i));
+                    if (!operand) {
+                        continue;
+                    }
+                    Constant *replaced =
+                                replaceInConstant(operand, range.gv, pointer);
+                    if (replaced != operand) {
+                        I.setOperand(i, replaced);
+                    }
+                }
+            }
+        }
+
+        // Replicas are not used by any other version of the kernel.
+        range.gv->removeDeadConstantUsers();
+        if (range.gv->use_empty() && range.gv->hasLocalLinkage()) {
+            range.gv->eraseFromParent();
+        }
+    }
+}
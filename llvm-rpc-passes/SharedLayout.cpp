@@ -0,0 +1,414 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Layout of the replicated shared memory arrays
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+#include "BankConflictAnalysisPass.h"
+#include "TargetDescription.h"
+
+extern cl::opt<std::string> CLCoarseningSmemLayout;
+extern cl::opt<bool> CLCoarseningSmemPadding;
+
+bool getLaneStride(const SCEV *scev, int64_t& stride)
+{
+    // Distance of the value between neighbouring threads of a warp, i.e.
+    // its coefficient of threadIdx.x. Threads of a warp are assumed to
+    // share the other built-ins.
+    stride = 0;
+
+    if (isa<SCEVConstant>(scev)) {
+        return true;
+    }
+
+    if (const SCEVUnknown *unknown = dyn_cast<SCEVUnknown>(scev)) {
+        Value *value = unknown->getValue();
+        if (isa<Argument>(value) || isa<Constant>(value)) {
+            return true;
+        }
+
+        CallInst *call = dyn_cast<CallInst>(value);
+        Function *callee = call ? call->getCalledFunction() : nullptr;
+        std::string prefix = std::string("llvm.") + CUDA_READ_SPECIAL_REG;
+        if (!callee || !callee->getName().startswith(prefix)) {
+            return false;
+        }
+        stride = (callee->getName() == prefix + "." + CUDA_THREAD_ID_REG +
+                                       ".x") ? 1 : 0;
+        return true;
+    }
+
+    if (const SCEVCastExpr *cast = dyn_cast<SCEVCastExpr>(scev)) {
+        return getLaneStride(cast->getOperand(), stride);
+    }
+
+    if (const SCEVAddExpr *add = dyn_cast<SCEVAddExpr>(scev)) {
+        for (const SCEV *operand : add->operands()) {
+            int64_t operandStride = 0;
+            if (!getLaneStride(operand, operandStride)) {
+                return false;
+            }
+            stride += operandStride;
+        }
+        return true;
+    }
+
+    if (const SCEVMulExpr *mul = dyn_cast<SCEVMulExpr>(scev)) {
+        // Threads differ in one factor at most, the others are constant.
+        int64_t scale = 1;
+        const SCEV *varying = nullptr;
+        for (const SCEV *operand : mul->operands()) {
+            int64_t operandStride = 0;
+            if (!getLaneStride(operand, operandStride)) {
+                return false;
+            }
+            if (isa<SCEVConstant>(operand)) {
+                scale *= cast<SCEVConstant>(operand)->getAPInt().getSExtValue();
+            }
+            else if (operandStride != 0) {
+                if (varying) {
+                    return false;
+                }
+                varying = operand;
+                stride = operandStride;
+            }
+            else {
+                // Uniform, but not constant.
+                scale = 0;
+            }
+        }
+        if (varying && scale == 0) {
+            return false;
+        }
+        stride *= scale;
+        return true;
+    }
+
+    if (const SCEVAddRecExpr *addRec = dyn_cast<SCEVAddRecExpr>(scev)) {
+        // Loop induction, threads differ in the start only.
+        for (unsigned int i = 1; i < addRec->getNumOperands(); ++i) {
+            int64_t operandStride = 0;
+            if (!getLaneStride(addRec->getOperand(i), operandStride) ||
+                operandStride != 0) {
+                return false;
+            }
+        }
+        return getLaneStride(addRec->getStart(), stride);
+    }
+
+    // Any other expression is fine as long as it is the same for the warp.
+    SmallVector<const SCEV *, 4> operands;
+    if (const SCEVNAryExpr *nary = dyn_cast<SCEVNAryExpr>(scev)) {
+        operands.append(nary->op_begin(), nary->op_end());
+    }
+    else if (const SCEVUDivExpr *div = dyn_cast<SCEVUDivExpr>(scev)) {
+        operands.push_back(div->getLHS());
+        operands.push_back(div->getRHS());
+    }
+    else {
+        return false;
+    }
+
+    for (const SCEV *operand : operands) {
+        int64_t operandStride = 0;
+        if (!getLaneStride(operand, operandStride) || operandStride != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool getElementStrides(GetElementPtrInst          *gep,
+                       GlobalVariable             *gv,
+                       std::vector<uint64_t>&      strides)
+{
+    // 'gv[0][i][j]...' down to a scalar element of the array, 'strides' is
+    // the number of elements each of the indices 'i', 'j', ... steps over.
+    strides.clear();
+    if (gep->getPointerOperand() != gv) {
+        return false;
+    }
+
+    ConstantInt *first = dyn_cast<ConstantInt>(gep->getOperand(1));
+    if (!first || !first->isZero()) {
+        return false;
+    }
+
+    Type *type = gv->getValueType();
+    std::vector<uint64_t> sizes;
+    while (ArrayType *arrayType = dyn_cast<ArrayType>(type)) {
+        sizes.push_back(arrayType->getNumElements());
+        type = arrayType->getElementType();
+    }
+    if (sizes.empty() || gep->getNumIndices() != sizes.size() + 1 ||
+        !type->isSingleValueType() || type->isVectorTy()) {
+        return false;
+    }
+
+    strides.assign(sizes.size(), 1);
+    for (unsigned int i = sizes.size() - 1; i > 0; --i) {
+        strides[i - 1] = strides[i] * sizes[i];
+    }
+    return true;
+}
+
+bool isUsedIn(Constant *constant, Function& F)
+{
+    for (User *user : constant->users()) {
+        if (Instruction *inst = dyn_cast<Instruction>(user)) {
+            if (inst->getFunction() == &F) {
+                return true;
+            }
+        }
+        else if (Constant *userConstant = dyn_cast<Constant>(user)) {
+            if (isUsedIn(userConstant, F)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+unsigned int bankConflictDegree(const std::vector<uint64_t>& addresses)
+{
+    // Number of distinct words the busiest bank serves, one is conflict-free.
+    std::map<uint64_t, std::set<uint64_t>> words;
+    unsigned int degree = 1;
+    for (uint64_t address : addresses) {
+        uint64_t word = address / SHARED_BANK_WIDTH;
+        std::set<uint64_t>& bankWords = words[word % SHARED_BANKS];
+        bankWords.insert(word);
+        degree = std::max(degree, (unsigned int) bankWords.size());
+    }
+    return degree;
+}
+
+uint64_t paddedIndex(uint64_t index, uint64_t rowElements, bool padding)
+{
+    // One element of padding after every row of banks.
+    return padding ? index + index / rowElements : index;
+}
+
+void CUDACoarseningPass::layoutSharedReplicas(Function& F)
+{
+    // The replicas of a divergent shared array are either kept as separate
+    // arrays, concatenated into one array, or interleaved element by element,
+    // optionally padded after every row of banks. Interleaving multiplies the
+    // distance between the threads of a warp by the factor, which the padding
+    // may turn into fewer bank conflicts (e.g. for column accesses of a tile).
+    if (m_globalsCoarseningMap.empty() ||
+        CLCoarseningSmemLayout == "separate") {
+        return;
+    }
+
+    ScalarEvolution *SE =
+                    &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+    Module& M = *F.getParent();
+    const DataLayout& DL = M.getDataLayout();
+    bool padding = CLCoarseningSmemPadding;
+
+    for (auto& mapIter : m_globalsCoarseningMap) {
+        GlobalVariable *gv = mapIter.first;
+        std::vector<GlobalVariable *> slots = { gv };
+        slots.insert(slots.end(), mapIter.second.begin(), mapIter.second.end());
+
+        // The accesses of F must be instructions, the original array may
+        // be used by other versions of the kernel as well.
+        bool concatenable = gv->hasInitializer() &&
+                            isa<UndefValue>(gv->getInitializer());
+        bool interleavable = concatenable;
+        for (GlobalVariable *slot : slots) {
+            for (User *user : slot->users()) {
+                Instruction *inst = dyn_cast<Instruction>(user);
+                std::vector<uint64_t> strides;
+                if (!inst) {
+                    Constant *constant = dyn_cast<Constant>(user);
+                    if (!constant || isUsedIn(constant, F)) {
+                        concatenable = interleavable = false;
+                    }
+                }
+                else if (inst->getFunction() == &F &&
+                         (!isa<GetElementPtrInst>(inst) ||
+                          !getElementStrides(cast<GetElementPtrInst>(inst),
+                                             slot,
+                                             strides))) {
+                    interleavable = false;
+                }
+            }
+        }
+
+        Type *elementType = gv->getValueType();
+        uint64_t elements = 1;
+        while (ArrayType *arrayType = dyn_cast<ArrayType>(elementType)) {
+            elements *= arrayType->getNumElements();
+            elementType = arrayType->getElementType();
+        }
+        uint64_t elementSize = DL.getTypeAllocSize(elementType);
+        uint64_t rowElements = std::max<uint64_t>(
+                            1, SHARED_BANKS * SHARED_BANK_WIDTH / elementSize);
+
+        // Bank conflicts of the accesses of the original array, replicas
+        // access their slots the same way.
+        unsigned int separateCost = 0;
+        unsigned int interleavedCost = 0;
+        for (User *user : gv->users()) {
+            GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(user);
+            std::vector<uint64_t> strides;
+            if (!gep || gep->getFunction() != &F ||
+                !getElementStrides(gep, gv, strides)) {
+                continue;
+            }
+
+            int64_t laneStride = 0;
+            bool known = true;
+            for (unsigned int i = 0; i < strides.size(); ++i) {
+                Value *index = gep->getOperand(i + 2);
+                int64_t indexStride = 0;
+                known &= getLaneStride(SE->getSCEV(index), indexStride);
+                laneStride += indexStride * strides[i];
+            }
+            if (!known) {
+                continue;
+            }
+            laneStride = std::abs(laneStride);
+
+            std::vector<uint64_t> separate;
+            std::vector<uint64_t> interleaved;
+            for (uint64_t lane = 0; lane < m_target->warpSize; ++lane) {
+                uint64_t index = lane * laneStride;
+                separate.push_back(index * elementSize);
+                interleaved.push_back(
+                        paddedIndex(index * m_factor, rowElements, padding) *
+                        elementSize);
+            }
+            separateCost += bankConflictDegree(separate);
+            interleavedCost += bankConflictDegree(interleaved);
+        }
+
+        SharedLayout layout = SHARED_SEPARATE;
+        if (CLCoarseningSmemLayout == "concatenated" && concatenable) {
+            layout = SHARED_CONCATENATED;
+        }
+        else if (CLCoarseningSmemLayout == "interleaved" && interleavable) {
+            layout = SHARED_INTERLEAVED;
+        }
+        else if (CLCoarseningSmemLayout == "auto" && interleavable &&
+                 interleavedCost < separateCost) {
+            layout = SHARED_INTERLEAVED;
+        }
+        else if (CLCoarseningSmemLayout != "auto") {
+            errs() << "--  WARN  -- Shared array " << gv->getName()
+                   << " cannot be laid out as " << CLCoarseningSmemLayout
+                   << ", keeping separate replicas\n";
+        }
+
+        errs() << "--  INFO  -- Shared array " << gv->getName() << ": "
+               << (layout == SHARED_SEPARATE ? "separate" :
+                   layout == SHARED_CONCATENATED ? "concatenated" :
+                                                   "interleaved")
+               << " layout (bank conflicts: separate " << separateCost
+               << ", interleaved " << interleavedCost << ")\n";
+
+        if (layout == SHARED_SEPARATE) {
+            continue;
+        }
+
+        // Slot 'k' of the combined array replaces replica 'k'.
+        Type *combinedType =
+            (layout == SHARED_CONCATENATED)
+            ? ArrayType::get(gv->getValueType(), m_factor)
+            : ArrayType::get(elementType,
+                             paddedIndex(elements * m_factor - 1,
+                                         rowElements,
+                                         padding) + 1);
+        GlobalVariable *combined = new GlobalVariable(
+                               M,
+                               combinedType,
+                               gv->isConstant(),
+                               gv->getLinkage(),
+                               UndefValue::get(combinedType),
+                               gv->getName() + "_cf",
+                               (GlobalVariable *) nullptr,
+                               gv->getThreadLocalMode(),
+                               gv->getType()->getAddressSpace());
+        combined->copyAttributesFrom(gv);
+        combined->setAlignment(std::max<unsigned int>(gv->getAlignment(), 16));
+
+        IntegerType *indexType = Type::getInt64Ty(M.getContext());
+        for (unsigned int k = 0; k < slots.size(); ++k) {
+            GlobalVariable *slot = slots[k];
+            InstVector users;
+            for (User *user : slot->users()) {
+                Instruction *inst = dyn_cast<Instruction>(user);
+                if (inst && inst->getFunction() == &F) {
+                    users.push_back(inst);
+                }
+            }
+
+            if (layout == SHARED_CONCATENATED) {
+                Constant *indices[] = { ConstantInt::get(indexType, 0),
+                                        ConstantInt::get(indexType, k) };
+                Constant *slotPointer = ConstantExpr::getInBoundsGetElementPtr(
+                                                                combinedType,
+                                                                combined,
+                                                                indices);
+                for (Instruction *inst : users) {
+                    inst->replaceUsesOfWith(slot, slotPointer);
+                }
+            }
+            else {
+                // Element 'i' of replica 'k' is element 'i * factor + k'.
+                for (Instruction *inst : users) {
+                    GetElementPtrInst *gep = cast<GetElementPtrInst>(inst);
+                    std::vector<uint64_t> strides;
+                    getElementStrides(gep, slot, strides);
+
+                    IRBuilder<> builder(gep);
+                    Value *index = builder.getInt64(k);
+                    for (unsigned int i = 0; i < strides.size(); ++i) {
+                        Value *operand = builder.CreateSExtOrTrunc(
+                                                    gep->getOperand(i + 2),
+                                                    indexType);
+                        index = builder.CreateAdd(
+                                    index,
+                                    builder.CreateMul(
+                                        operand,
+                                        builder.getInt64(strides[i] *
+                                                         m_factor)));
+                    }
+                    if (padding) {
+                        index = builder.CreateAdd(
+                                    index,
+                                    builder.CreateUDiv(
+                                        index,
+                                        builder.getInt64(rowElements)));
+                    }
+
+                    Value *element = builder.CreateInBoundsGEP(
+                                            combinedType,
+                                            combined,
+                                            { builder.getInt64(0), index },
+                                            gep->getName());
+                    gep->replaceAllUsesWith(element);
+                    gep->eraseFromParent();
+                }
+            }
+
+            if (slot != gv && slot->use_empty()) {
+                slot->eraseFromParent();
+            }
+        }
+    }
+}
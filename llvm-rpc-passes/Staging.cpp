@@ -0,0 +1,350 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Shared memory staging of stride-1 replicated global accesses
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+
+extern cl::opt<bool> CLCoarseningStaging;
+
+// Shared memory helpers.
+bool getLaneStride(const SCEV *scev, int64_t& stride);
+bool isExecutedOnce(BasicBlock        *block,
+                    DominatorTree     *DT,
+                    PostDominatorTree *PDT,
+                    LoopInfo          *LI);
+
+// NVVM annotation helpers.
+bool findOneNVVMAnnotation(const GlobalValue  *gv,
+                           const std::string&  prop,
+                           unsigned int&       retval);
+
+bool isGlobalAccess(Value *pointer, const DataLayout& DL)
+{
+    unsigned int addressSpace = pointer->getType()->getPointerAddressSpace();
+    if (addressSpace != 0 && addressSpace != 1) {
+        return false;
+    }
+
+    Value *object = GetUnderlyingObject(pointer, DL);
+    GlobalVariable *gv = dyn_cast<GlobalVariable>(object);
+    return !isa<AllocaInst>(object) &&
+           (!gv || gv->getType()->getAddressSpace() == 0 ||
+                   gv->getType()->getAddressSpace() == 1);
+}
+
+bool touchesGlobalMemory(Instruction       *inst,
+                         bool               writes,
+                         const DataLayout&  DL)
+{
+    // Conservatively true for anything but shared and local accesses.
+    if (writes ? !inst->mayWriteToMemory() : !inst->mayReadFromMemory()) {
+        return false;
+    }
+    if (Util::isBarrier(inst)) {
+        return false;
+    }
+
+    Value *pointer = getLoadStorePointerOperand(inst);
+    return !pointer || isGlobalAccess(pointer, DL);
+}
+
+bool isMemoryQuiet(Instruction       *inst,
+                   bool               before,
+                   const InstVector&  group,
+                   const DataLayout&  DL)
+{
+    // No other global write may precede the 'inst' (before), respectively
+    // no global read or write may follow it, on any path through the
+    // kernel. The staged access moves to other threads of the block, which
+    // would race with the accesses of the thread itself. The accesses of
+    // the staged 'group' are exempt.
+    auto conflicts = [&](Instruction *other) {
+        if (std::find(group.begin(), group.end(), other) != group.end()) {
+            return false;
+        }
+        return touchesGlobalMemory(other, before, DL) ||
+               (!before && touchesGlobalMemory(other, true, DL));
+    };
+
+    BasicBlock *block = inst->getParent();
+    bool isBefore = true;
+    for (Instruction& I : *block) {
+        if (&I == inst) {
+            isBefore = false;
+        }
+        else if (isBefore == before && conflicts(&I)) {
+            return false;
+        }
+    }
+
+    std::set<BasicBlock *> visited = { block };
+    BlockVector worklist = { block };
+    while (!worklist.empty()) {
+        BasicBlock *current = worklist.back();
+        worklist.pop_back();
+
+        BlockVector next;
+        if (before) {
+            next.assign(pred_begin(current), pred_end(current));
+        }
+        else {
+            next.assign(succ_begin(current), succ_end(current));
+        }
+        for (BasicBlock *other : next) {
+            if (!visited.insert(other).second) {
+                continue;
+            }
+            for (Instruction& I : *other) {
+                if (conflicts(&I)) {
+                    return false;
+                }
+            }
+            worklist.push_back(other);
+        }
+    }
+    return true;
+}
+
+void CUDACoarseningPass::stageReplicas(Function& F, Function& bounds)
+{
+    // With stride 1, thread 't' accesses the elements 't * factor + k' and
+    // the accesses of a warp are 'factor' elements apart. Global loads and
+    // stores of the replicas are staged through a shared memory tile
+    // instead: the threads of the block copy the tile cooperatively, with
+    // neighbouring threads on neighbouring elements, and the replicas read
+    // (write) their elements of the tile. The accesses must be executed by
+    // all the threads, and the tile is sized by the launch bounds.
+    if (!CLCoarseningStaging || m_blockLevel || m_stride != 1 ||
+        m_dimension != 0 || m_factor < 2 || hasReplicaGuards()) {
+        return;
+    }
+    for (unsigned int dimension = 1; dimension < CUDA_MAX_DIM; ++dimension) {
+        if (m_factors[dimension] > 1) {
+            return;
+        }
+    }
+
+    // Threads of the original block, at most.
+    unsigned int threads = 1;
+    bool bounded = false;
+    for (std::string prop : { "reqntid", "maxntid" }) {
+        unsigned int value = 0;
+        if (bounded || !findOneNVVMAnnotation(&bounds, prop + "x", value)) {
+            continue;
+        }
+        threads = value;
+        for (std::string dim : { "y", "z" }) {
+            if (findOneNVVMAnnotation(&bounds, prop + dim, value)) {
+                threads *= value;
+            }
+        }
+        bounded = true;
+    }
+    if (!bounded) {
+        errs() << "--  INFO  -- No launch bounds, global accesses of "
+               << F.getName() << " not staged\n";
+        return;
+    }
+
+    Module& M = *F.getParent();
+    const DataLayout& DL = M.getDataLayout();
+    ScalarEvolution *SE =
+                    &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+    DominatorTree *DT =
+                &getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+    PostDominatorTree *PDT =
+                &getAnalysis<PostDominatorTreeWrapperPass>(F).getPostDomTree();
+    LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+
+    // Replicated global accesses of consecutive elements.
+    std::vector<InstVector> groups;
+    for (auto& mapIter : m_coarseningMap) {
+        Instruction *original = mapIter.first;
+        InstVector group = { original };
+        group.insert(group.end(), mapIter.second.begin(), mapIter.second.end());
+
+        Value *pointer = getLoadStorePointerOperand(original);
+        if (!pointer || group.size() != m_factor ||
+            !isGlobalAccess(pointer, DL) ||
+            !isExecutedOnce(original->getParent(), DT, PDT, LI)) {
+            continue;
+        }
+
+        Type *type = pointer->getType()->getPointerElementType();
+        uint64_t size = DL.getTypeStoreSize(type);
+        const SCEV *first = SE->getSCEV(pointer);
+        int64_t laneStride = 0;
+        bool consecutive = getLaneStride(first, laneStride) &&
+                           laneStride == (int64_t) (m_factor * size);
+        for (unsigned int k = 0; k < group.size() && consecutive; ++k) {
+            Instruction *replica = group[k];
+            Value *replicaPointer = getLoadStorePointerOperand(replica);
+            const SCEVConstant *distance = nullptr;
+            if (replicaPointer &&
+                replica->getOpcode() == original->getOpcode() &&
+                replica->getParent() == original->getParent() &&
+                replicaPointer->getType() == pointer->getType()) {
+                distance = dyn_cast<SCEVConstant>(
+                            SE->getMinusSCEV(SE->getSCEV(replicaPointer),
+                                             first));
+            }
+            consecutive = distance &&
+                    distance->getAPInt().getSExtValue() == (int64_t) (k * size);
+        }
+
+        LoadInst *load = dyn_cast<LoadInst>(original);
+        StoreInst *store = dyn_cast<StoreInst>(original);
+        if (!consecutive || !(load ? load->isSimple()
+                                   : store && store->isSimple())) {
+            continue;
+        }
+
+        // The loads are copied in before the first replica, the stores are
+        // copied out after the last one. No global write may precede the
+        // last load, and no other global access may follow the first store.
+        Instruction *front = original;
+        Instruction *back = original;
+        for (Instruction *replica : group) {
+            front = DT->dominates(replica, front) ? replica : front;
+            back = DT->dominates(back, replica) ? replica : back;
+        }
+        Instruction *pointerInst = dyn_cast<Instruction>(pointer);
+        if ((pointerInst && !DT->dominates(pointerInst, front)) ||
+            !isMemoryQuiet(load ? back : front, load, group, DL)) {
+            continue;
+        }
+        groups.push_back(group);
+    }
+
+    Function *barrier = cast<Function>(M.getOrInsertFunction(
+                std::string(LLVM_PREFIX) + "." + CUDA_BARRIER,
+                Type::getVoidTy(M.getContext())).getCallee());
+    std::string prefix = std::string("llvm.") + CUDA_READ_SPECIAL_REG + ".";
+    auto readRegister = [&](IRBuilder<>& builder, std::string reg) {
+        FunctionCallee readReg = M.getOrInsertFunction(prefix + reg,
+                                                       builder.getInt32Ty());
+        return builder.CreateZExt(builder.CreateCall(readReg),
+                                  builder.getInt64Ty());
+    };
+
+    for (InstVector& group : groups) {
+        bool isLoad = isa<LoadInst>(group.front());
+        Value *pointer = getLoadStorePointerOperand(group.front());
+        Type *type = pointer->getType()->getPointerElementType();
+
+        ArrayType *tileType = ArrayType::get(type, threads);
+        GlobalVariable *tile = new GlobalVariable(
+                                   M,
+                                   tileType,
+                                   false,
+                                   GlobalValue::InternalLinkage,
+                                   UndefValue::get(tileType),
+                                   pointer->getName() + ".stage",
+                                   (GlobalVariable *) nullptr,
+                                   GlobalValue::NotThreadLocal,
+                                   3);
+        tile->setAlignment(16);
+
+        Instruction *front = group.front();
+        Instruction *back = group.front();
+        for (Instruction *access : group) {
+            front = DT->dominates(access, front) ? access : front;
+            back = DT->dominates(back, access) ? access : back;
+        }
+
+        // Threads of a row (same y, z) copy the 'factor * ntid.x' elements
+        // of the row, starting at the element of thread 0 of the row.
+        IRBuilder<> builder(front);
+        Value *tid = readRegister(builder,
+                                  std::string(CUDA_THREAD_ID_REG) + ".x");
+        Value *ntid = readRegister(builder,
+                                   std::string(CUDA_BLOCK_DIM_REG) + ".x");
+        Value *row = builder.CreateAdd(
+                builder.CreateMul(
+                    readRegister(builder,
+                                 std::string(CUDA_THREAD_ID_REG) + ".z"),
+                    readRegister(builder,
+                                 std::string(CUDA_BLOCK_DIM_REG) + ".y")),
+                readRegister(builder,
+                             std::string(CUDA_THREAD_ID_REG) + ".y"));
+        Value *rowBase = builder.CreateMul(
+                            builder.CreateMul(row, ntid),
+                            builder.getInt64(m_factor),
+                            "stage.row");
+        Value *first = builder.CreateAdd(
+                            rowBase,
+                            builder.CreateMul(tid, builder.getInt64(m_factor)),
+                            "stage.first");
+        Value *globalBase = builder.CreateGEP(
+                type,
+                pointer,
+                builder.CreateNeg(builder.CreateMul(
+                                        tid,
+                                        builder.getInt64(m_factor))),
+                "stage.base");
+
+        // Replica 'k' accesses element 'tid * factor + k' of the row.
+        for (unsigned int k = 0; k < group.size(); ++k) {
+            Instruction *access = group[k];
+            IRBuilder<> accessBuilder(access);
+            Value *element = accessBuilder.CreateInBoundsGEP(
+                    tileType,
+                    tile,
+                    { accessBuilder.getInt64(0),
+                      accessBuilder.CreateAdd(first,
+                                              accessBuilder.getInt64(k)) });
+            access->setOperand(isLoad ? 0 : 1, element);
+        }
+
+        if (!isLoad) {
+            // Wait for the whole tile, then copy out.
+            builder.SetInsertPoint(back->getNextNode());
+            builder.CreateCall(barrier);
+        }
+
+        for (unsigned int j = 0; j < m_factor; ++j) {
+            Value *index = builder.CreateAdd(
+                                builder.CreateMul(builder.getInt64(j), ntid),
+                                tid);
+            Value *global = builder.CreateGEP(type, globalBase, index);
+            Value *shared = builder.CreateInBoundsGEP(
+                                tileType,
+                                tile,
+                                { builder.getInt64(0),
+                                  builder.CreateAdd(rowBase, index) });
+            if (isLoad) {
+                builder.CreateStore(builder.CreateLoad(type, global), shared);
+            }
+            else {
+                builder.CreateStore(builder.CreateLoad(type, shared), global);
+            }
+        }
+
+        if (isLoad) {
+            // Copy in, then wait for the whole tile.
+            builder.CreateCall(barrier);
+        }
+    }
+
+    if (!groups.empty()) {
+        errs() << "--  INFO  -- Staged " << groups.size()
+               << " replicated global accesses through shared memory\n";
+    }
+}
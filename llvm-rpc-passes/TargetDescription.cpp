@@ -0,0 +1,73 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Resource limits and instruction costs of the GPU generations
+// ============================================================================
+
+#include <llvm/IR/Function.h>
+#include <llvm/Support/CommandLine.h>
+
+#include "Common.h"
+#include "TargetDescription.h"
+
+using namespace llvm;
+
+extern cl::opt<std::string> CLCoarseningTarget;
+
+// Ordered by the SM version. The costs of sm_61 are the ones the benefit
+// model was built with, the memory costs of the other generations follow
+// their relative shared and global memory latencies.
+static const std::vector<targetDescription> g_targets = {
+//   SM  warp  smem/blk  smem/SM   regs/SM  regs  thr/blk  thr/SM
+//   def  div2 div  mod2 mod  lds  sts  ldg  stg  br   mathF mathD
+    {30, 32,   0xc000,   0xc000,   65536,   63,   1024,    2048,
+     100, 200, 300, 150, 350, 150, 150, 250, 250, 150, 200,  300},
+    {35, 32,   0xc000,   0xc000,   65536,   255,  1024,    2048,
+     100, 200, 300, 150, 350, 150, 150, 250, 250, 150, 200,  300},
+    {50, 32,   0xc000,   0x10000,  65536,   255,  1024,    2048,
+     100, 200, 300, 150, 350, 150, 150, 200, 200, 150, 200,  300},
+    {52, 32,   0xc000,   0x18000,  65536,   255,  1024,    2048,
+     100, 200, 300, 150, 350, 150, 150, 200, 200, 150, 200,  300},
+    {60, 32,   0xc000,   0x10000,  65536,   255,  1024,    2048,
+     100, 200, 300, 150, 350, 150, 150, 200, 200, 150, 200,  300},
+    {61, 32,   0xc000,   0x18000,  65536,   255,  1024,    2048,
+     100, 200, 300, 150, 350, 150, 150, 200, 200, 150, 200,  300},
+    {70, 32,   0xc000,   0x18000,  65536,   255,  1024,    2048,
+     100, 200, 300, 150, 350, 120, 120, 180, 180, 150, 200,  300},
+    {75, 32,   0xc000,   0x10000,  65536,   255,  1024,    1024,
+     100, 200, 300, 150, 350, 120, 120, 180, 180, 150, 200,  300},
+    {80, 32,   0xc000,   0x29000,  65536,   255,  1024,    2048,
+     100, 200, 300, 150, 350, 120, 120, 180, 180, 150, 200,  300}
+};
+
+const targetDescription *findTargetDescription(const std::string& name)
+{
+    if (name.compare(0, 3, "sm_") != 0 || name.size() < 5) {
+        return nullptr;
+    }
+
+    // Variants such as sm_90a share the description of the generation.
+    unsigned int version = atoi(name.c_str() + 3);
+    const targetDescription *result = nullptr;
+    for (const targetDescription& target : g_targets) {
+        if (target.smVersion <= version) {
+            result = &target;
+        }
+    }
+    return result;
+}
+
+const targetDescription& getTargetDescription(const Function& F)
+{
+    std::string name = CLCoarseningTarget;
+    if (name.empty() && F.hasFnAttribute("target-cpu")) {
+        name = F.getFnAttribute("target-cpu").getValueAsString().str();
+    }
+
+    const targetDescription *target = findTargetDescription(name);
+    if (!target) {
+        target = findTargetDescription(CUDA_DEFAULT_TARGET);
+    }
+    return *target;
+}
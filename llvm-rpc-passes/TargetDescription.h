@@ -0,0 +1,52 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Resource limits and instruction costs of the GPU generations
+// ============================================================================
+
+#ifndef LLVM_LIB_TRANSFORMS_CUDA_COARSENING_TARGETDESCRIPTION_H
+#define LLVM_LIB_TRANSFORMS_CUDA_COARSENING_TARGETDESCRIPTION_H
+
+#define CUDA_DEFAULT_TARGET "sm_61"
+
+namespace llvm {
+    class Function;
+}
+
+struct targetDescription {
+    unsigned int smVersion;          // e.g. 61 for sm_61
+
+    // Resources
+    unsigned int warpSize;           // Threads of a warp
+    uint64_t     sharedPerBlock;     // Static shared memory of a block
+    uint64_t     sharedPerSM;        // Shared memory of a multiprocessor
+    unsigned int registersPerSM;     // 32-bit registers of a multiprocessor
+    unsigned int registersPerThread; // 32-bit registers of a thread
+    unsigned int maxThreadsPerBlock;
+    unsigned int maxThreadsPerSM;
+
+    // Relative instruction costs, a simple ALU instruction costs 100
+    unsigned int costDefault;        // Default instruction cost
+    unsigned int costDivPow2;        // Division, divisor is power of two
+    unsigned int costDivNPow2;       // Division, divisor is not power of two
+    unsigned int costModPow2;        // Modulo, divisor is power of two
+    unsigned int costModNPow2;       // Modulo, divisor is not power of two
+    unsigned int costLoadShared;     // Shared memory load
+    unsigned int costStoreShared;    // Shared memory store
+    unsigned int costLoadGlobal;     // Global memory load
+    unsigned int costStoreGlobal;    // Global memory store
+    unsigned int costBranchDiv;      // Divergent branch
+    unsigned int costMathFuncF;      // FP32 built-in math function
+    unsigned int costMathFuncD;      // FP64 built-in math function
+};
+
+const targetDescription *findTargetDescription(const std::string& name);
+    // Description of the 'name' (sm_XY) target, or of the newest older
+    // generation in the table. Returns nullptr if the name is not valid.
+
+const targetDescription& getTargetDescription(const llvm::Function& F);
+    // Description selected by the coarsening-target option, otherwise the
+    // one of the "target-cpu" of F, falling back to CUDA_DEFAULT_TARGET.
+
+#endif // LLVM_LIB_TRANSFORMS_CUDA_COARSENING_TARGETDESCRIPTION_H
@@ -10,6 +10,8 @@
 #include "RegionBounds.h"
 #include "DivergentRegion.h"
 
+#include <sstream>
+
 using namespace llvm;
 
 bool findOneNVVMAnnotation(const GlobalValue  *gv,
@@ -19,7 +21,7 @@ bool findOneNVVMAnnotation(const GlobalValue  *gv,
 bool Util::shouldCoarsen(Function&   F,
                          std::string kernelName,
                          bool        isHostCode,
-                         bool        isDynamicMode)
+                         bool        isAllMode)
 {
     if (F.isDeclaration()) {
         // F does not contain the function body.
@@ -33,14 +35,14 @@ bool Util::shouldCoarsen(Function&   F,
 
     std::string name = Util::nameFromDemangled(Util::demangle(F.getName()));
 
-    if (isDynamicMode && kernelName != "all" && name != kernelName) {
-        // In dynamic mode, kernel name "all" means we generate coarsened
-        // versions of all the kernels. However, if kernel name is specified,
-        // only that kernel is processed.
+    if (isAllMode && kernelName != "all" && name != kernelName) {
+        // In dynamic and auto mode, kernel name "all" means we coarsen all
+        // the kernels. However, if kernel name is specified, only that
+        // kernel is processed.
         return false;
     }
 
-    if (!isDynamicMode && name != kernelName) {
+    if (!isAllMode && name != kernelName) {
         // In regular mode, name has to match.
         return false;
     }
@@ -107,6 +109,26 @@ std::string Util::dimensionToString(unsigned int dimension)
     return tmp[dimension];
 }
 
+bool Util::parseTile(std::string tile, std::vector<unsigned int>& values)
+{
+    // Per-dimension values of the x, y and z dimensions, e.g. "4x2".
+    std::istringstream ts(tile);
+    std::string token;
+
+    unsigned int dimension = 0;
+    while (std::getline(ts, token, 'x')) {
+        // Digits only, getAsInteger also fails on values out of range.
+        if (dimension >= CUDA_MAX_DIM || token.empty() ||
+            token.find_first_not_of("0123456789") != std::string::npos ||
+            StringRef(token).getAsInteger(10, values[dimension]) ||
+            values[dimension] == 0) {
+            return false;
+        }
+        ++dimension;
+    }
+    return dimension != 0;
+}
+
 bool Util::isKernelFunction(llvm::Function& F)
 {
     unsigned int x = 0;
@@ -152,6 +174,19 @@ void Util::findUsesOf(Instruction *inst, InstSet &result, bool skipBranches) {
     }
 }
 
+bool Util::isBarrier(Instruction *inst)
+{
+    CallInst *call = dyn_cast<CallInst>(inst);
+    if (!call || !call->getCalledFunction()) {
+        return false;
+    }
+
+    std::string name = LLVM_PREFIX;
+    name.append(".");
+    name.append(CUDA_BARRIER);
+    return call->getCalledFunction()->getName() == name;
+}
+
 BasicBlock *Util::findImmediatePostDom(BasicBlock              *block,
                                        const PostDominatorTree *pdt) {
     return pdt->getNode(block)->getIDom()->getBlock();
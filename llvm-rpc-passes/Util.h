@@ -2,6 +2,7 @@
 #define LLVM_LIB_TRANSFORMS_CUDA_COARSENING_UTIL_H
 
 #define CUDA_TARGET_TRIPLE         "nvptx64-nvidia-cuda"
+#define CUDA_COARSENING_REMARKS    "cuda-coarsening"
 
 // https://reviews.llvm.org/D57488
 // In CUDA 9.2+, new version of launching kernels was implemented.
@@ -40,6 +41,8 @@
 #define CUDA_SHUFFLE_BFLY      "nvvm.shfl.bfly"
 #define CUDA_SHUFFLE_IDX       "nvvm.shfl.idx"
 
+#define CUDA_BARRIER           "nvvm.barrier0"
+
 namespace llvm {
     class Function;
     class Instruction;
@@ -57,16 +60,19 @@ class Util {
     static bool shouldCoarsen(llvm::Function& F,
                               std::string     kernelName,
                               bool            isHostCode,
-                              bool            isDynamicMode);
+                              bool            isAllMode);
     static std::string demangle(std::string mangledName);
     static std::string nameFromDemangled(std::string demangledName);
     static unsigned int numeralDimension(std::string strDim);
     static std::string dimensionToString(unsigned int dimension);
+    static bool parseTile(std::string                tile,
+                          std::vector<unsigned int>& values);
     static bool isKernelFunction(llvm::Function& F);
     static std::string cudaVarToRegister(std::string var);
     static void findUsesOf(llvm::Instruction *inst,
                            InstSet&           result,
                            bool               skipBranches = false);
+    static bool isBarrier(llvm::Instruction *inst);
     static llvm::BasicBlock *findImmediatePostDom(
                                            llvm::BasicBlock              *block,
                                            const llvm::PostDominatorTree *pdt);
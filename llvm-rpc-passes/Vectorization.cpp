@@ -0,0 +1,230 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// CUDA Coarsening Transformation pass
+// -> Vectorization of replicated memory accesses
+// ============================================================================
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+
+#include "Common.h"
+#include "CUDACoarsening.h"
+#include "Util.h"
+
+#define VECTOR_MAX_BYTES 16u /* Widest NVPTX access, ld/st.global.v4.b32 */
+#define VECTOR_MAX_WIDTH 4u  /* Widest NVPTX vector                      */
+
+extern cl::opt<bool> CLCoarseningVectorize;
+extern cl::opt<bool> CLCoarseningAssumeAligned;
+
+// Support functions.
+//-----------------------------------------------------------------------------
+Value *getAccessPointer(Instruction *inst) {
+    if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        return load->getPointerOperand();
+    }
+    return cast<StoreInst>(inst)->getPointerOperand();
+}
+
+Type *getAccessType(Instruction *inst) {
+    if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        return load->getType();
+    }
+    return cast<StoreInst>(inst)->getValueOperand()->getType();
+}
+
+bool isSimpleAccess(Instruction *inst) {
+    if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        return load->isSimple();
+    }
+    if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+        return store->isSimple();
+    }
+    return false;
+}
+
+unsigned int getBaseAlignment(const SCEV *base) {
+    const SCEVUnknown *unknown = dyn_cast<SCEVUnknown>(base);
+    if (!unknown) {
+        return 0;
+    }
+
+    Value *value = unknown->getValue()->stripPointerCasts();
+    if (GlobalVariable *gv = dyn_cast<GlobalVariable>(value)) {
+        return gv->getAlignment();
+    }
+    if (Argument *arg = dyn_cast<Argument>(value)) {
+        return arg->getParamAlignment();
+    }
+    return 0;
+}
+
+// Vectorization.
+//-----------------------------------------------------------------------------
+void CUDACoarseningPass::vectorizeReplicas(Function& F)
+{
+    // Only stride-1 thread coarsening places replicas of an access
+    // on consecutive elements. A vector access of guarded replicas would
+    // read past the extent or the early exit.
+    if (!CLCoarseningVectorize || hasReplicaGuards() || m_blockLevel ||
+        m_stride != 1) {
+        return;
+    }
+
+    ScalarEvolution *SE =
+                    &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+    const DataLayout& DL = F.getParent()->getDataLayout();
+
+    // Instructions shared by several groups, or appearing twice in one,
+    // are loads reused across the replicas. Vectorizing such a group
+    // would erase an instruction another group still refers to.
+    std::map<Instruction *, unsigned int> occurrences;
+    for (auto& mapIter : m_coarseningMap) {
+        ++occurrences[mapIter.first];
+        for (Instruction *replica : mapIter.second) {
+            ++occurrences[replica];
+        }
+    }
+
+    // Collect the groups first, vectorization erases the replicas.
+    std::vector<InstVector> groups;
+    for (auto& mapIter : m_coarseningMap) {
+        Instruction *inst = mapIter.first;
+        if (!isa<LoadInst>(inst) && !isa<StoreInst>(inst)) {
+            continue;
+        }
+        if (mapIter.second.size() != m_factor - 1) {
+            continue;
+        }
+
+        InstVector group(1, inst);
+        group.insert(group.end(), mapIter.second.begin(), mapIter.second.end());
+        bool shared = std::any_of(group.begin(),
+                                  group.end(),
+                                  [&](Instruction *member) {
+                                      return occurrences[member] > 1;
+                                  });
+        if (!shared) {
+            groups.push_back(group);
+        }
+    }
+
+    unsigned int vectorized = 0;
+    for (InstVector& group : groups) {
+        Type *type = getAccessType(group[0]);
+        if (!type->isIntegerTy() && !type->isFloatingPointTy()) {
+            continue;
+        }
+
+        unsigned int size = DL.getTypeStoreSize(type);
+        unsigned int width = std::min(m_factor, VECTOR_MAX_WIDTH);
+        width = std::min(width, VECTOR_MAX_BYTES / size);
+        if (width < 2) {
+            continue;
+        }
+
+        bool changed = false;
+        for (unsigned int first = 0; first + width <= group.size();
+             first += width) {
+            InstVector chunk(group.begin() + first,
+                             group.begin() + first + width);
+            if (vectorizeAccesses(chunk, SE, DL)) {
+                changed = true;
+                ++vectorized;
+            }
+        }
+
+        if (changed) {
+            // Some of the replicas do not exist anymore.
+            m_coarseningMap.erase(group[0]);
+        }
+    }
+
+    if (vectorized) {
+        errs() << "--  INFO  -- Vectorized " << vectorized
+               << " groups of replicated memory accesses\n";
+    }
+}
+
+bool CUDACoarseningPass::vectorizeAccesses(InstVector&       chunk,
+                                           ScalarEvolution  *SE,
+                                           const DataLayout& DL)
+{
+    Instruction *head = chunk.front();
+    Type *type = getAccessType(head);
+    unsigned int size = DL.getTypeStoreSize(type);
+    unsigned int bytes = size * chunk.size();
+    Value *headPtr = getAccessPointer(head);
+    const SCEV *headAddr = SE->getSCEV(headPtr);
+
+    // Replicas follow each other in the block and access consecutive
+    // elements (replica k reads element k of the chunk).
+    for (unsigned int index = 0; index < chunk.size(); ++index) {
+        Instruction *inst = chunk[index];
+        if (!isSimpleAccess(inst) || getAccessType(inst) != type) {
+            return false;
+        }
+        if (index > 0 && inst->getPrevNode() != chunk[index - 1]) {
+            return false;
+        }
+
+        const SCEVConstant *distance = dyn_cast<SCEVConstant>(
+                SE->getMinusSCEV(SE->getSCEV(getAccessPointer(inst)), headAddr));
+        if (!distance || distance->getAPInt() != index * size) {
+            return false;
+        }
+    }
+
+    // Vector accesses have to be naturally aligned.
+    if (!CLCoarseningAssumeAligned) {
+        const SCEV *base = SE->getPointerBase(headAddr);
+        const SCEV *offset = SE->getMinusSCEV(headAddr, base);
+        uint32_t zeros = std::min(SE->GetMinTrailingZeros(offset), 31u);
+
+        if (getBaseAlignment(base) < bytes || (1u << zeros) < bytes) {
+            return false;
+        }
+    }
+
+    VectorType *vecType = VectorType::get(type, chunk.size());
+    unsigned int addrSpace = headPtr->getType()->getPointerAddressSpace();
+
+    if (isa<LoadInst>(head)) {
+        IRBuilder<> builder(head);
+        Value *vecPtr = builder.CreatePointerCast(
+                                    headPtr,
+                                    vecType->getPointerTo(addrSpace));
+        Value *vecLoad = builder.CreateAlignedLoad(vecPtr,
+                                                   bytes,
+                                                   head->getName() + ".vec");
+        for (unsigned int index = 0; index < chunk.size(); ++index) {
+            Value *element = builder.CreateExtractElement(vecLoad, index);
+            chunk[index]->replaceAllUsesWith(element);
+        }
+    }
+    else {
+        IRBuilder<> builder(chunk.back()->getNextNode());
+        Value *vecPtr = builder.CreatePointerCast(
+                                    headPtr,
+                                    vecType->getPointerTo(addrSpace));
+        Value *vecValue = UndefValue::get(vecType);
+        for (unsigned int index = 0; index < chunk.size(); ++index) {
+            StoreInst *store = cast<StoreInst>(chunk[index]);
+            vecValue = builder.CreateInsertElement(vecValue,
+                                                   store->getValueOperand(),
+                                                   index);
+        }
+        builder.CreateAlignedStore(vecValue, vecPtr, bytes, false);
+    }
+
+    for (Instruction *inst : chunk) {
+        inst->eraseFromParent();
+    }
+
+    return true;
+}
@@ -0,0 +1,207 @@
+// ============================================================================
+// Copyright (c) Richard Rohac, 2019, All rights reserved.
+// ============================================================================
+// Offline calibration of the cost model of the CUDA coarsening pass
+// -> Fits the costs of the keys of the model to measured run times
+// ============================================================================
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define CALIBRATE_ITERATIONS 10000
+#define CALIBRATE_TOLERANCE  1e-12
+#define CALIBRATE_SCALE      100.0  // Cost of the 'default' key
+
+typedef std::map<std::string, std::map<std::string, double>> featureMap_t;
+typedef std::map<std::string, double> runtimeMap_t;
+
+inline std::vector<std::string> splitLine(const std::string& line)
+{
+    std::istringstream ts(line);
+    std::string token;
+
+    std::vector<std::string> tokens;
+    while (std::getline(ts, token, ',')) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+bool readFeatures(const char *path, featureMap_t *features)
+{
+    // <version>,<key>,<executions per original thread>, as written by the
+    // pass with -coarsening-cost-features.
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> tokens = splitLine(line);
+        if (tokens.size() != 3) {
+            continue;
+        }
+        (*features)[tokens[0]][tokens[1]] = atof(tokens[2].c_str());
+    }
+    return true;
+}
+
+bool readRuntimes(const char *path, runtimeMap_t *runtimes)
+{
+    // <version>,<run time per original thread>, any unit.
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> tokens = splitLine(line);
+        if (tokens.size() != 2 || tokens[0].empty() || tokens[0][0] == '#') {
+            continue;
+        }
+        (*runtimes)[tokens[0]] = atof(tokens[1].c_str());
+    }
+    return true;
+}
+
+std::vector<double> fitCosts(const std::vector<std::vector<double>>& rows,
+                             const std::vector<double>&              times)
+{
+    // Non-negative least squares by cyclic coordinate descent on the normal
+    // equations, costs cannot be negative.
+    unsigned int keys = rows.empty() ? 0 : rows[0].size();
+    std::vector<std::vector<double>> ata(keys, std::vector<double>(keys, 0));
+    std::vector<double> atb(keys, 0);
+    for (unsigned int r = 0; r < rows.size(); ++r) {
+        for (unsigned int i = 0; i < keys; ++i) {
+            atb[i] += rows[r][i] * times[r];
+            for (unsigned int j = 0; j < keys; ++j) {
+                ata[i][j] += rows[r][i] * rows[r][j];
+            }
+        }
+    }
+
+    std::vector<double> costs(keys, 0);
+    for (unsigned int it = 0; it < CALIBRATE_ITERATIONS; ++it) {
+        double change = 0;
+        for (unsigned int i = 0; i < keys; ++i) {
+            if (ata[i][i] == 0) {
+                continue;
+            }
+
+            double gradient = -atb[i];
+            for (unsigned int j = 0; j < keys; ++j) {
+                gradient += ata[i][j] * costs[j];
+            }
+            double cost = std::max(0.0, costs[i] - gradient / ata[i][i]);
+            change = std::max(change, std::fabs(cost - costs[i]));
+            costs[i] = cost;
+        }
+        if (change < CALIBRATE_TOLERANCE) {
+            break;
+        }
+    }
+    return costs;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 4) {
+        printf("Usage: rpc-calibrate <features> <runtimes> [<cost model>]\n");
+        return 1;
+    }
+
+    featureMap_t features;
+    runtimeMap_t runtimes;
+    if (!readFeatures(argv[1], &features)) {
+        printf("RPC_ERROR: cannot read features %s\n", argv[1]);
+        return 1;
+    }
+    if (!readRuntimes(argv[2], &runtimes)) {
+        printf("RPC_ERROR: cannot read runtimes %s\n", argv[2]);
+        return 1;
+    }
+
+    // Keys of all of the measured versions.
+    std::vector<std::string> versions;
+    std::map<std::string, unsigned int> keyIndices;
+    std::vector<std::string> keys;
+    for (auto& runtime : runtimes) {
+        auto it = features.find(runtime.first);
+        if (it == features.end()) {
+            printf("RPC_WARN: no features of %s\n", runtime.first.c_str());
+            continue;
+        }
+        versions.push_back(runtime.first);
+        for (auto& feature : it->second) {
+            if (keyIndices.insert({feature.first, keys.size()}).second) {
+                keys.push_back(feature.first);
+            }
+        }
+    }
+
+    if (versions.empty()) {
+        printf("RPC_ERROR: no measured version has features\n");
+        return 1;
+    }
+    if (versions.size() < keys.size()) {
+        printf("RPC_WARN: %zu versions for %zu keys, the fit is not unique\n",
+               versions.size(), keys.size());
+    }
+
+    std::vector<std::vector<double>> rows;
+    std::vector<double> times;
+    for (const std::string& version : versions) {
+        std::vector<double> row(keys.size(), 0);
+        for (auto& feature : features[version]) {
+            row[keyIndices[feature.first]] = feature.second;
+        }
+        rows.push_back(row);
+        times.push_back(runtimes[version]);
+    }
+
+    std::vector<double> costs = fitCosts(rows, times);
+
+    // Costs are relative, the 'default' key (or the largest cost) is scaled
+    // to the cost of a simple instruction.
+    double reference = 0;
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        if (keys[i] == "default" && costs[i] > 0) {
+            reference = costs[i];
+            break;
+        }
+        reference = std::max(reference, costs[i]);
+    }
+    double scale = reference > 0 ? CALIBRATE_SCALE / reference : 0;
+
+    for (unsigned int r = 0; r < rows.size(); ++r) {
+        double predicted = 0;
+        for (unsigned int i = 0; i < keys.size(); ++i) {
+            predicted += rows[r][i] * costs[i];
+        }
+        printf("%-40s measured %12.6g predicted %12.6g\n",
+               versions[r].c_str(), times[r], predicted);
+    }
+
+    std::ofstream file;
+    if (argc == 4) {
+        file.open(argv[3]);
+    }
+    std::ostream& os = (argc == 4) ? file : std::cout;
+    os << "# Cost model fitted by rpc-calibrate from " << versions.size()
+       << " versions\n";
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        os << keys[i] << " " << costs[i] * scale << "\n";
+    }
+
+    return 0;
+}
@@ -22,12 +22,15 @@ struct uint3 {
 typedef std::unordered_map<std::string, const char *> nameKernelMap_t;
 typedef std::unordered_map<const char *, const char *> kernelPtrMap_t;
 
+#define CUDA_MAX_DIM         3
+
 struct coarseningConfig {
     std::string name;
     bool block;
-    unsigned int factor;
-    unsigned int stride;
-    unsigned int direction;
+    unsigned int factor[CUDA_MAX_DIM]; // 1 if not coarsened
+    unsigned int stride[CUDA_MAX_DIM];
+    unsigned int direction;            // Last coarsened dimension
+    bool swizzle;                      // Diagonal order of the blocks
 };
 
 inline std::string demangle(std::string mangledName)
@@ -90,6 +93,28 @@ inline unsigned int errorFallback(const void  *ptr,
     return cudaLaunchKernel(ptr, gridDim, blockDim, args, sharedMem, stream);
 }
 
+inline std::vector<unsigned int> parseTile(const std::string& str)
+{
+    std::istringstream ts(str);
+    std::string token;
+
+    std::vector<unsigned int> values;
+    while (std::getline(ts, token, 'x')) {
+        // Digits only, as the coarsening pass accepts them. Nine digits
+        // always fit an unsigned int.
+        if (token.empty() || token.size() > 9 ||
+            token.find_first_not_of("0123456789") != std::string::npos) {
+            return std::vector<unsigned int>();
+        }
+
+        values.push_back(strtoul(token.c_str(), nullptr, 10));
+        if (values.back() == 0) {
+            return std::vector<unsigned int>();
+        }
+    }
+    return values;
+}
+
 inline bool parseConfig(char *str, coarseningConfig *result)
 {
     std::istringstream ts(str);
@@ -100,27 +125,50 @@ inline bool parseConfig(char *str, coarseningConfig *result)
         tokens.push_back(token);
     }
 
-    if (tokens.size() != 5) {
+    // Block-level versions may swizzle the blocks, e.g.
+    // <kernelname>,x,block,4,1,diagonal
+    if (tokens.size() != 5 && tokens.size() != 6) {
         return false;
     }
 
-    if (tokens[2] != "block" && tokens[2] != "thread") {
+    if (tokens.size() == 6 &&
+        (tokens[2] != "block" ||
+         (tokens[5] != "diagonal" && tokens[5] != "none"))) {
         return false;
     }
 
-    result->name = tokens[0];
-    if (tokens[1] == "x") {
-        result->direction = 0;
+    if (tokens[2] != "block" && tokens[2] != "thread") {
+        return false;
     }
-    else if (tokens[1] == "y") {
-        result->direction = 1;
+
+    // Tiles coarsen several dimensions, e.g. <kernelname>,xy,thread,4x2,1
+    std::vector<unsigned int> directions;
+    for (char dim : tokens[1]) {
+        if (dim < 'x' || dim > 'z') {
+            return false;
+        }
+        directions.push_back(dim - 'x');
     }
-    else {
-        result->direction = 2;
+
+    std::vector<unsigned int> factors = parseTile(tokens[3]);
+    std::vector<unsigned int> strides = parseTile(tokens[4]);
+    if (directions.empty() || factors.size() != directions.size() ||
+        (strides.size() != 1 && strides.size() != directions.size())) {
+        return false;
     }
+
+    result->name = tokens[0];
     result->block = tokens[2] == "block";
-    result->factor = atoi(tokens[3].c_str());
-    result->stride = atoi(tokens[4].c_str());
+    result->swizzle = tokens.size() == 6 && tokens[5] == "diagonal";
+    for (unsigned int dim = 0; dim < CUDA_MAX_DIM; ++dim) {
+        result->factor[dim] = 1;
+        result->stride[dim] = 1;
+    }
+    for (unsigned int i = 0; i < directions.size(); ++i) {
+        result->direction = directions[i];
+        result->factor[directions[i]] = factors[i];
+        result->stride[directions[i]] = strides[strides.size() == 1 ? 0 : i];
+    }
 
     return true;
 }
@@ -172,12 +220,13 @@ const void rpcRegisterFunction(void       **fatCubinHandle,
                            wSize);
 }
 
-extern "C" unsigned int rpcLaunchKernel(const void  *ptr, 
-                                        dim3         gridDim,
-                                        dim3         blockDim,
-                                        void       **args,
-                                        size_t       sharedMem,
-                                        void        *stream)
+extern "C" unsigned int rpcLaunchKernel(const void   *ptr, 
+                                        dim3          gridDim,
+                                        dim3          blockDim,
+                                        void        **args,
+                                        size_t        sharedMem,
+                                        void         *stream,
+                                        unsigned int  argCount)
 {
     char *kernelConfig = getenv("RPC_CONFIG");
     if (!kernelConfig) {
@@ -186,24 +235,54 @@ extern "C" unsigned int rpcLaunchKernel(const void  *ptr,
 
     coarseningConfig config; 
 
-    // Expected format <kernelname>,<dim>,<block/thread>,<factor>,<stride>
+    // Expected format <kernelname>,<dims>,<block/thread>,<factors>,<strides>
+    // optionally followed by ,<swizzle>
     if (!parseConfig(kernelConfig, &config)) {
         return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
     }
 
+    // Name of the version, see 'namedKernelVersion' of the pass.
+    std::string dims;
+    std::string factors;
+    std::string strides;
+    for (unsigned int dim = 0; dim < CUDA_MAX_DIM; ++dim) {
+        if (config.factor[dim] == 1) {
+            continue;
+        }
+        if (!dims.empty()) {
+            factors.append("x");
+            strides.append("x");
+        }
+        dims.append(std::to_string(dim));
+        factors.append(std::to_string(config.factor[dim]));
+        strides.append(std::to_string(config.stride[dim]));
+    }
+
     std::string nameScaled;
     nameScaled.append(config.name);
     nameScaled.append("_");
-    nameScaled.append(std::to_string(config.direction));
+    nameScaled.append(dims);
     nameScaled.append("_");
-    nameScaled.append(std::to_string(config.block ? config.factor : 1));
+    nameScaled.append(config.block ? factors : "1");
     nameScaled.append("_");
-    nameScaled.append(std::to_string(config.block ? 1 : config.factor));
+    nameScaled.append(config.block ? "1" : factors);
     nameScaled.append("_");
-    nameScaled.append(std::to_string(config.stride));
+    nameScaled.append(strides);
+    if (config.swizzle) {
+        nameScaled.append("_sw");
+    }
 
+    // Guarded versions take the original extent of the coarsened dimension
+    // as the last argument and run on a grid rounded up.
     const nameKernelMap_t& map = getNameKernelMap();
-    nameKernelMap_t::const_iterator it = map.find(nameScaled);
+    nameKernelMap_t::const_iterator it = map.find(nameScaled + "_g");
+    bool guarded = it != map.end();
+    if (guarded) {
+        nameScaled.append("_g");
+    }
+    else {
+        it = map.find(nameScaled);
+    }
     if (it == map.end()) {
         printf ("RPC_ERROR: kernel not found #1 %s\n", nameScaled.c_str());
         return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
@@ -221,42 +300,44 @@ extern "C" unsigned int rpcLaunchKernel(const void  *ptr,
         return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
     }
 
-    if (!config.block && config.direction == 0 &&
-        config.stride > (blockDim.x / config.factor)) {
-        printf("RPC_ERROR: Stride parameter too big for X dimension!\n");
-        return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
-    }
-
-    if (!config.block && config.direction == 1 &&
-        config.stride > (blockDim.y / config.factor)) {
-        printf("RPC_ERROR: Stride parameter too big for Y dimension!\n");
-        return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
-    }
-
-    if (!config.block && config.direction == 2 &&
-        config.stride > (blockDim.z / config.factor)) {
-        printf("RPC_ERROR:  Stride parameter too big for Z dimension!\n");
-        return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
-    }
-
     dim3 *scaledDim = config.block ? &gridDim : &blockDim;
-    if (config.direction == 0) {
-        if (scaledDim->x / config.factor == 0) {
-            return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
+    unsigned int *scaledDims[CUDA_MAX_DIM] = {
+        &scaledDim->x, &scaledDim->y, &scaledDim->z
+    };
+
+    for (unsigned int dim = 0; dim < CUDA_MAX_DIM; ++dim) {
+        if (config.factor[dim] > 1 &&
+            config.stride[dim] > (*scaledDims[dim] / config.factor[dim])) {
+            printf("RPC_ERROR: Stride parameter too big for %c dimension!\n",
+                   'X' + dim);
+            return errorFallback(ptr, gridDim, blockDim, args, sharedMem,
+                                 stream);
         }
-        scaledDim->x /= config.factor;
     }
-    else if (config.direction == 1) {
-        if (scaledDim->y / config.factor == 0) {
-            return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
-        }
-        scaledDim->y /= config.factor;
+
+    unsigned int extent = *scaledDims[config.direction];
+    std::vector<void *> guardedArgs;
+    if (guarded) {
+        // Whole tiles of 'factor * stride' elements, 'stride' threads each.
+        unsigned int factor = config.factor[config.direction];
+        unsigned int stride = config.stride[config.direction];
+        unsigned int tile = factor * stride;
+        *scaledDims[config.direction] = (extent + tile - 1) / tile * stride;
+
+        guardedArgs.assign(args, args + argCount);
+        guardedArgs.push_back(&extent);
+        args = guardedArgs.data();
     }
     else {
-        if (scaledDim->z / config.factor == 0) {
-            return errorFallback(ptr, gridDim, blockDim, args, sharedMem, stream);
+        for (unsigned int dim = 0; dim < CUDA_MAX_DIM; ++dim) {
+            if (*scaledDims[dim] / config.factor[dim] == 0) {
+                return errorFallback(ptr, gridDim, blockDim, args, sharedMem,
+                                     stream);
+            }
+        }
+        for (unsigned int dim = 0; dim < CUDA_MAX_DIM; ++dim) {
+            *scaledDims[dim] /= config.factor[dim];
         }
-        scaledDim->z /= config.factor;
     }
 
     return cudaLaunchKernel(it->second,
@@ -16,14 +16,18 @@
 # Coarsening configuration is to be supplied through the environment variable
 # as well:
 #
-# RPC_CONFIG=<kernelName (or "all" for all to be coarsened in dynamic mode)>,
+# RPC_CONFIG=<kernelName (or "all" for all to be coarsened in dynamic or
+#             auto mode)>,
 #            <dimension (x/y/z)>,
-#            <mode (thread,block,dynamic)>,
+#            <mode (thread,block,dynamic,auto)>,
 #            <coarsening factor>,
 #            <coarsening stride>
 #
 # For example, RPC_CONFIG=matrixTranspose,x,thread,2,32
 #
+# In auto mode, the dimension, factor and stride of every kernel are chosen
+# by the pass, e.g. RPC_CONFIG=all,x,auto,1,1
+#
 # ------------------------------------------------------------------------------
 # General script usage format:
 # RPC_CONFIG="..." m3c.sh <input> <output> <builddir> <incdir>
@@ -88,7 +92,10 @@ $RPC_LLVM_BIN_DIR/clang++ -x cuda -c -emit-llvm $OPT $INPUT_FILE              \
 $RPC_LLVM_BIN_DIR/llvm-dis $BUILD_DIR/rpc_device.bc -o $BUILD_DIR/rpc_device.ll
 $RPC_LLVM_BIN_DIR/llvm-dis $BUILD_DIR/rpc_host.bc -o $BUILD_DIR/rpc_host.ll
 
-# Optimize the device code using our pass
+# Optimize the device code using our pass, the configurations chosen in auto
+# mode are passed to the host code pass through a file (left empty if no
+# kernel is worth coarsening)
+: > $BUILD_DIR/rpc_auto.cfg
 $RPC_LLVM_BIN_DIR/opt -load $RPC_LLVM_BUILD_DIR/lib/LLVMCUDACoarsening.so     \
                       -mem2reg -indvars -structurizecfg -be                   \
                       -cuda-coarsening-pass                                   \
@@ -97,6 +104,8 @@ $RPC_LLVM_BIN_DIR/opt -load $RPC_LLVM_BUILD_DIR/lib/LLVMCUDACoarsening.so     \
                       -coarsening-factor $COARSENING_FACTOR                   \
                       -coarsening-stride $COARSENING_STRIDE                   \
                       -coarsening-mode $COARSENING_MODE                       \
+                      -coarsening-target $RPC_DEVICE_ARCH                     \
+                      -coarsening-auto-config $BUILD_DIR/rpc_auto.cfg         \
                       -o $BUILD_DIR/rpc_device_coarsened.bc                   \
                        < $BUILD_DIR/rpc_device.bc
 
@@ -160,6 +169,7 @@ $RPC_LLVM_BIN_DIR/opt -load $RPC_LLVM_BUILD_DIR/lib/LLVMCUDACoarsening.so      \
                       -coarsening-factor $COARSENING_FACTOR                    \
                       -coarsening-stride $COARSENING_STRIDE                    \
                       -coarsening-mode $COARSENING_MODE                        \
+                      -coarsening-auto-config $BUILD_DIR/rpc_auto.cfg          \
                       -o $BUILD_DIR/rpc_combined_coarsened.bc                  \
                        < $BUILD_DIR/rpc_combined.ll
 
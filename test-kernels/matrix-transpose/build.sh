@@ -4,8 +4,8 @@
 LLVM_BUILD_DIR=/DATA/LLVM/build_debug/
 LLVM_BIN_DIR=/DATA/LLVM/build_debug/bin
 CUDA_DIR=/opt/cuda
-DEVICE_ARCH=sm_61
-DEVICE_COMPUTE_ARCH=compute_61
+DEVICE_ARCH=${DEVICE_ARCH:-sm_61}
+DEVICE_COMPUTE_ARCH=${DEVICE_COMPUTE_ARCH:-compute_${DEVICE_ARCH#sm_}}
 STRIDE=1
 FACTOR=1
 MODE=dynamic
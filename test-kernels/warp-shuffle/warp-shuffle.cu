@@ -68,6 +68,42 @@ __global__ void reduceSmem (int *g_idata, int *g_odata, unsigned int n)
     if (tid == 0) g_odata[blockIdx.x] = smem[0];
 }
 
+// Shared memory tree without early exit and volatile accesses: the shape
+// the stride-1 thread coarsening pre-reduces in registers
+// (-coarsening-pre-reduce).
+__global__ void reduceSmemTree (int *g_idata, int *g_odata, unsigned int n)
+{
+    __shared__ int smem[DIM];
+
+    // set thread ID
+    unsigned int tid = threadIdx.x;
+
+    // boundary check, threads past the end contribute the neutral element
+    unsigned int idx = blockIdx.x * blockDim.x + threadIdx.x;
+
+    smem[tid] = (idx < n) ? g_idata[idx] : 0;
+    __syncthreads();
+
+    // in-place reduction in shared memory, DIM threads per block
+    if (tid < 64) smem[tid] += smem[tid + 64];
+    __syncthreads();
+    if (tid < 32) smem[tid] += smem[tid + 32];
+    __syncthreads();
+    if (tid < 16) smem[tid] += smem[tid + 16];
+    __syncthreads();
+    if (tid < 8)  smem[tid] += smem[tid + 8];
+    __syncthreads();
+    if (tid < 4)  smem[tid] += smem[tid + 4];
+    __syncthreads();
+    if (tid < 2)  smem[tid] += smem[tid + 2];
+    __syncthreads();
+    if (tid < 1)  smem[tid] += smem[tid + 1];
+    __syncthreads();
+
+    // write result for this block to global mem
+    if (tid == 0) g_odata[blockIdx.x] = smem[0];
+}
+
 __inline__ __device__ int warpReduce(int localSum)
 {
     localSum += __shfl_xor(localSum, 16);
@@ -323,6 +359,18 @@ int main(int argc, char **argv)
     printf("reduceSmem          : %d <<<grid %d block %d>>>\n", gpu_sum, grid.x,
            block.x);
 
+    // reduce smem tree
+    CHECK(cudaMemcpy(d_idata, h_idata, bytes, cudaMemcpyHostToDevice));
+    reduceSmemTree<<<grid.x, block>>>(d_idata, d_odata, size);
+    CHECK(cudaMemcpy(h_odata, d_odata, grid.x * sizeof(int),
+                     cudaMemcpyDeviceToHost));
+    gpu_sum = 0;
+
+    for (int i = 0; i < grid.x; i++) gpu_sum += h_odata[i];
+
+    printf("reduceSmemTree      : %d <<<grid %d block %d>>>\n", gpu_sum, grid.x,
+           block.x);
+
     // reduce smem
     CHECK(cudaMemcpy(d_idata, h_idata, bytes, cudaMemcpyHostToDevice));
     reduceShfl<<<grid.x, block>>>(d_idata, d_odata, size);